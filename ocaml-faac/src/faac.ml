@@ -23,3 +23,72 @@ let encode_ni eh inbuf inbufofs inbuflen =
       done
     done;
     encode eh buf 0 (chans*inbuflen)
+
+module Pool =
+struct
+  type config =
+      {
+        rate : int;
+        channels : int;
+        bitrate : int;
+        bandwidth : int;
+        mpeg_version : int;
+      }
+
+  type encoder =
+      {
+        encoder : t;
+        samples : int;
+        buflen : int;
+        config : config;
+      }
+
+  type pool =
+      {
+        max_idle : int;
+        idle : (config, encoder list) Hashtbl.t;
+      }
+
+  let create ?(max_idle=4) () =
+    { max_idle = max_idle; idle = Hashtbl.create 5 }
+
+  let idle pool config =
+    try Hashtbl.find pool.idle config with Not_found -> []
+
+  let open_encoder config =
+    let enc, samples, buflen = create config.rate config.channels in
+      set_configuration enc
+        ~mpeg_version:config.mpeg_version
+        ~bitrate:config.bitrate
+        ~bandwidth:config.bandwidth ();
+      { encoder = enc; samples = samples; buflen = buflen; config = config }
+
+  let prepare pool config n =
+    let n = min n pool.max_idle in
+    let rec fill l k =
+      if k >= n then l else fill (open_encoder config :: l) (k + 1)
+    in
+    let l = idle pool config in
+      Hashtbl.replace pool.idle config (fill l (List.length l))
+
+  let get pool config =
+    match idle pool config with
+      | e :: l ->
+          Hashtbl.replace pool.idle config l;
+          e
+      | [] -> open_encoder config
+
+  (* libfaac cannot be rewound once it has been fed (a flushed encoder only
+   * outputs empty frames), so "resetting" a handle means replacing it with a
+   * freshly configured one. This is done here, at the end of a stream, instead
+   * of when the next one starts. *)
+  let release pool e =
+    close e.encoder;
+    let l = idle pool e.config in
+      if List.length l < pool.max_idle then
+        Hashtbl.replace pool.idle e.config (open_encoder e.config :: l)
+
+  let clear pool =
+    Hashtbl.iter (fun _ l -> List.iter (fun e -> close e.encoder) l) pool.idle;
+    Hashtbl.clear pool.idle
+end
@@ -21,3 +21,55 @@ val encode : t -> float array -> int -> int -> string -> int -> int
 
 (** Same as [encode] but take non-interleaved data as input. *)
 val encode_ni : t -> float array array -> int -> int -> string -> int -> int
+
+(** Pools of pre-opened and pre-configured encoders. Opening and configuring
+  * an encoder is costly, so that streams started on demand should take their
+  * encoder from a pool instead of calling [create] and [set_configuration].
+  * Pools are not thread-safe: accesses from several threads should be
+  * protected by a mutex. *)
+module Pool :
+sig
+  (** Parameters of an encoder, [bitrate] is per-channel as in
+    * [set_configuration]. *)
+  type config =
+      {
+        rate : int;
+        channels : int;
+        bitrate : int;
+        bandwidth : int;
+        mpeg_version : int;
+      }
+
+  (** An encoder taken from a pool, together with the number of samples that
+    * should be fed at each [encode] call and the maximum number of bytes of
+    * the output buffer (as returned by [create]). *)
+  type encoder =
+      {
+        encoder : t;
+        samples : int;
+        buflen : int;
+        config : config;
+      }
+
+  type pool
+
+  (** Create an empty pool keeping at most [max_idle] (defaults to 4) idle
+    * encoders for each configuration. *)
+  val create : ?max_idle:int -> unit -> pool
+
+  (** [prepare pool config n] opens encoders for [config] until [n] of them
+    * are idle in the pool. *)
+  val prepare : pool -> config -> int -> unit
+
+  (** Take an encoder from the pool, opening a new one if none is idle for
+    * the given configuration. *)
+  val get : pool -> config -> encoder
+
+  (** Give back an encoder to the pool. It should not be used afterwards: it
+    * is closed and a fresh encoder with the same configuration is put in the
+    * pool instead, unless there are already enough idle ones. *)
+  val release : pool -> encoder -> unit
+
+  (** Close all idle encoders of the pool. *)
+  val clear : pool -> unit
+end
@@ -108,26 +108,88 @@ let ls uri =
     List.map (fun (a,b) -> (a,translate_kind b))
       ((find_proto proto).Proto.ls uri)
 
-let cp src dst =
-  let buflen = 64 * 1024 in
-  let buf = String.create buflen in
-  let fi = openfile src [O_RDONLY] 0o644 in begin try
-    let fo = openfile dst [O_WRONLY; O_CREAT; O_TRUNC] 0o644 in begin try
-      let flen = lseek fi 0 SEEK_END in
-      let written = ref 0 in
-        ignore (lseek fi 0 SEEK_SET);
-        while !written < flen
-        do
-          let l = read fi buf 0 buflen in
-            ignore (write fo buf 0 l);
-            written := !written + l
-        done
-      with e -> close fo; raise e
-      end;
-      close fo
-  with e -> close fi; raise e
-  end;
-  close fi
+let rec write_all fd buf ofs len =
+  if len > 0 then
+    let l = write fd buf ofs len in
+      write_all fd buf (ofs + l) (len - l)
+
+(* Large blocks are needed to get decent speeds on network backends. *)
+let cp_buflen = 1024 * 1024
+
+(* Copy [len] bytes at offset [ofs] of [fi] to the same offset of [fo]. *)
+let copy_range fi fo ofs len =
+  let buf = String.create (min cp_buflen (max len 1)) in
+  let buflen = String.length buf in
+  let rem = ref len in
+    ignore (lseek fi ofs SEEK_SET);
+    ignore (lseek fo ofs SEEK_SET);
+    while !rem > 0
+    do
+      let l = read fi buf 0 (min buflen !rem) in
+        if l = 0 then raise (Error End_of_file);
+        write_all fo buf 0 l;
+        rem := !rem - l
+    done
+
+let with_file uri flags f =
+  let fd = openfile uri flags 0o644 in
+  let ans =
+    try
+      f fd
+    with e -> close fd; raise e
+  in
+    close fd;
+    ans
+
+(* Each segment uses its own descriptors, so that backends can serve them
+ * concurrently. *)
+let cp_segments src dst flen segments =
+  (* Allocate the destination. *)
+  with_file dst [O_WRONLY; O_CREAT; O_TRUNC]
+    (fun fo ->
+       if flen > 0 then
+         (
+           ignore (lseek fo (flen - 1) SEEK_SET);
+           write_all fo "\000" 0 1
+         )
+    );
+  let seglen = (flen + segments - 1) / segments in
+  let errors = Array.make segments None in
+  let segment i =
+    let ofs = i * seglen in
+    let len = min seglen (flen - ofs) in
+      try
+        if len > 0 then
+          with_file src [O_RDONLY]
+            (fun fi ->
+               with_file dst [O_WRONLY]
+                 (fun fo -> copy_range fi fo ofs len))
+      with e -> errors.(i) <- Some e
+  in
+  let threads = Array.init segments (fun i -> Thread.create segment i) in
+    Array.iter Thread.join threads;
+    Array.iter (function Some e -> raise e | None -> ()) errors
+
+(* Segmented copies are not worth it for small files. *)
+let cp_min_segment = 4 * 1024 * 1024
+
+let cp_generic segments src dst =
+  with_file src [O_RDONLY]
+    (fun fi ->
+       let flen = lseek fi 0 SEEK_END in
+       let segments = min segments (flen / cp_min_segment) in
+         if segments > 1 then
+           cp_segments src dst flen segments
+         else
+           with_file dst [O_WRONLY; O_CREAT; O_TRUNC]
+             (fun fo -> copy_range fi fo 0 flen))
+
+(* Backends may copy files of their own protocol natively. *)
+let cp ?(segments=1) src dst =
+  let proto = get_protocol src in
+    match (find_proto proto).Proto.cp with
+      | Some cp when get_protocol dst = proto -> cp src dst
+      | _ -> cp_generic segments src dst
 
 let is_alive uri =
   let proto = get_protocol uri in
@@ -108,9 +108,12 @@ val ls : uri -> (uri * file_kind) list
 val basename : string -> string
 
 (** [cp source dest] copies the file [source] to [dest] (both arguments are
-  * uri).
+  * uri). Large files are split in [segments] parts (default: 1) copied
+  * concurrently, each one with its own descriptors. This only speeds up
+  * backends using a connection per descriptor, such as http and ftp: the
+  * smb backend shares a single context, whose operations are serialized.
   *)
-val cp : uri -> uri -> unit
+val cp : ?segments:int -> uri -> uri -> unit
 
 (** Is a server alive and available? *)
 val is_alive : uri -> bool
@@ -26,9 +26,7 @@
 
 (* $Id$ *)
 
-let hashsize = 10
-
-let used_fd : (int, Unix.file_descr) Hashtbl.t = Hashtbl.create hashsize
+let used_fd : Unix.file_descr Proto.fd_table = Proto.fd_table ()
 
 let my_flag = function
   | Proto.O_RDONLY -> Unix.O_RDONLY
@@ -42,41 +40,35 @@ let my_command = function
   | Proto.SEEK_CUR -> Unix.SEEK_CUR
   | Proto.SEEK_END -> Unix.SEEK_END
 
-let openfile =
+let openfile uri flags mode =
   begin try
-    let fdcount = ref 0 in
-      begin fun uri flags mode ->
-        assert (String.sub uri 0 7 = "file://");
-        let filename = String.sub uri 7 (String.length uri - 7) in
-        let file = Unix.openfile filename (List.map my_flag flags) mode in
-        let fd = !fdcount in
-          incr fdcount;
-          Hashtbl.add used_fd fd file;
-          fd
-      end
+    assert (String.sub uri 0 7 = "file://");
+    let filename = String.sub uri 7 (String.length uri - 7) in
+    let file = Unix.openfile filename (List.map my_flag flags) mode in
+      Proto.add_fd used_fd file
   with e -> raise (Fetch.Error e)
   end
 
 let close fd =
   begin try
-    Unix.close (Hashtbl.find used_fd fd);
-    Hashtbl.remove used_fd fd
+    Unix.close (Proto.find_fd used_fd fd);
+    Proto.remove_fd used_fd fd
   with e -> raise (Fetch.Error e)
   end
 
 let read fd =
   try
-    Unix.read (Hashtbl.find used_fd fd)
+    Unix.read (Proto.find_fd used_fd fd)
   with e -> raise (Fetch.Error e)
 
 let lseek fd offset command =
   try
-    Unix.lseek (Hashtbl.find used_fd fd) offset (my_command command)
+    Unix.lseek (Proto.find_fd used_fd fd) offset (my_command command)
   with e -> raise (Fetch.Error e)
 
 let write fd =
   try
-    Unix.write (Hashtbl.find used_fd fd)
+    Unix.write (Proto.find_fd used_fd fd)
   with e -> raise (Fetch.Error e)
 
 let ls uri =
@@ -114,6 +106,43 @@ let ls uri =
 
 let is_alive = fun _ -> true
 
+external copy_file : Unix.file_descr -> Unix.file_descr -> int -> int = "ocaml_fetch_copy_file"
+
+(* Copies are done by the kernel when possible. A buffered loop then copies
+ * whatever is left until the end of the file: the kernel may stop early, and
+ * the size can be wrong for growing or special files. *)
+let cp src dst =
+  assert (String.sub src 0 7 = "file://");
+  assert (String.sub dst 0 7 = "file://");
+  let src = String.sub src 7 (String.length src - 7) in
+  let dst = String.sub dst 7 (String.length dst - 7) in
+    begin try
+      let fi = Unix.openfile src [Unix.O_RDONLY] 0 in
+        begin try
+          let fo = Unix.openfile dst [Unix.O_WRONLY; Unix.O_CREAT; Unix.O_TRUNC] 0o644 in
+            begin try
+              let len = Int64.to_int (Unix.LargeFile.fstat fi).Unix.LargeFile.st_size in
+              let buf = String.create (1024 * 1024) in
+              let rec copy () =
+                let l = Unix.read fi buf 0 (String.length buf) in
+                  if l > 0 then
+                    (
+                      ignore (Unix.write fo buf 0 l);
+                      copy ()
+                    )
+              in
+                ignore (copy_file fi fo len);
+                copy ()
+            with e -> Unix.close fo; raise e
+            end;
+            Unix.close fo
+        with e -> Unix.close fi; raise e
+        end;
+        Unix.close fi
+    with
+      | e -> raise (Fetch.Error e)
+    end
+
 let () =
   Proto.register "file"
     {
@@ -124,4 +153,5 @@ let () =
       Proto.write = write;
       Proto.ls = ls;
       Proto.is_alive = is_alive;
+      Proto.cp = Some cp;
     }
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2003-2004  The Savonet Team
+ *
+ * This file is part of Ocaml-fetch.
+ *
+ * Ocaml-fetch is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Ocaml-fetch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ocaml-fetch; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Stubs for the "file" protocol plugin. */
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/signals.h>
+#include <caml/unixsupport.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#endif
+
+/* Copy at most len bytes from the current position of fdin to the current
+ * position of fdout inside the kernel, with copy_file_range or else
+ * sendfile. Returns the number of bytes copied: it is smaller than len at
+ * the end of the input, or when the kernel cannot copy between those files,
+ * in which case the caller copies the remaining data itself. */
+CAMLprim value ocaml_fetch_copy_file(value _fdin, value _fdout, value _len)
+{
+  CAMLparam3(_fdin, _fdout, _len);
+  long copied = 0;
+#ifdef __linux__
+  int fdin = Int_val(_fdin);
+  int fdout = Int_val(_fdout);
+  long len = Long_val(_len);
+  size_t chunk;
+  ssize_t n;
+  int err = 0;
+#ifdef SYS_copy_file_range
+  int use_sendfile = 0;
+#else
+  int use_sendfile = 1;
+#endif
+
+  caml_enter_blocking_section();
+  while (copied < len)
+  {
+    chunk = len - copied > (1 << 30) ? (1 << 30) : len - copied;
+#ifdef SYS_copy_file_range
+    if (!use_sendfile)
+    {
+      n = syscall(SYS_copy_file_range, fdin, NULL, fdout, NULL, chunk, 0);
+      if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+      {
+        use_sendfile = 1;
+        continue;
+      }
+    }
+    else
+#endif
+      n = sendfile(fdout, fdin, NULL, chunk);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EINVAL && errno != ENOSYS)
+        err = errno;
+      break;
+    }
+    if (n == 0)
+      break;
+    copied += n;
+  }
+  caml_leave_blocking_section();
+
+  if (err != 0)
+    unix_error(err, "copy_file", Nothing);
+#endif
+
+  CAMLreturn(Val_long(copied));
+}
@@ -26,9 +26,7 @@
 
 (* $Id$ *)
 
-let hashsize = 10
-
-let used_fd : (int, Ftp.File.file_descr) Hashtbl.t = Hashtbl.create hashsize
+let used_fd : Ftp.File.file_descr Proto.fd_table = Proto.fd_table ()
 
 let my_flag = function
   | Proto.O_RDONLY -> Ftp.File.O_RDONLY
@@ -41,33 +39,28 @@ let my_command = function
   | Proto.SEEK_CUR -> Ftp.File.SEEK_CUR
   | Proto.SEEK_END -> Ftp.File.SEEK_END
 
-let openfile =
+let openfile uri flags mode =
   begin try
-    let fdcount = ref 0 in
-      fun uri flags mode ->
-        let file = Ftp.File.openfile uri (List.map my_flag flags) mode in
-        let fd = !fdcount in
-          incr fdcount;
-          Hashtbl.add used_fd fd file;
-          fd
+    let file = Ftp.File.openfile uri (List.map my_flag flags) mode in
+      Proto.add_fd used_fd file
   with e -> raise (Fetch.Error e)
   end
 
 let close fd =
   begin try
-    Ftp.File.close (Hashtbl.find used_fd fd);
-    Hashtbl.remove used_fd fd
+    Ftp.File.close (Proto.find_fd used_fd fd);
+    Proto.remove_fd used_fd fd
   with e -> raise (Fetch.Error e)
   end
 
 let read fd =
   try
-    Ftp.File.read (Hashtbl.find used_fd fd)
+    Ftp.File.read (Proto.find_fd used_fd fd)
   with e -> raise (Fetch.Error e)
 
 let lseek fd offset command =
   try
-    Ftp.File.lseek (Hashtbl.find used_fd fd) offset (my_command command)
+    Ftp.File.lseek (Proto.find_fd used_fd fd) offset (my_command command)
   with e -> raise (Fetch.Error e)
 
 let write fd =
@@ -101,4 +94,5 @@ let () =
       Proto.write = write;
       Proto.ls = ls;
       Proto.is_alive = is_alive;
+      Proto.cp = None;
     }
@@ -26,94 +26,344 @@
 
 (* $Id$ *)
 
-(* TODO: very basic implementation, does not really support seeks, etc. *)
+(* Reads are done with Range requests, so that seeking does not need to
+ * download the file from the start. Connections are kept alive and reused
+ * between requests on the same server. *)
+
+type conn =
+    {
+      c_ic : in_channel;
+      c_oc : out_channel;
+    }
+
+(* Remaining part of the body of the current response. *)
+type body =
+  | No_body
+  | Length of int (** remaining bytes *)
+  | Chunked of int (** remaining bytes in the current chunk, 0 if the size of
+                     * the next chunk has to be read *)
+  | Until_eof
 
 type file =
     {
-      f_server : string;
+      f_host : string;
+      f_port : int;
       f_path : string;
       mutable f_pos : int;
-      f_ic : in_channel;
-      f_oc : out_channel;
+      mutable f_conn : conn option;
+      mutable f_body : body;
+      mutable f_keep_alive : bool;
       mutable f_len : int;
     }
 
-let hashsize = 10
+let used_fd : file Proto.fd_table = Proto.fd_table ()
+
+let get_fd = Proto.find_fd used_fd
+
+(** Forward seeks of at most this number of bytes are done by reading the
+  * current response instead of issuing a new request. *)
+let skip_threshold = 64 * 1024
+
+(** Maximal number of idle connections kept per server. *)
+let max_idle = 4
 
-let used_fd : (int, file) Hashtbl.t = Hashtbl.create hashsize
+let pool : (string * int, conn list) Hashtbl.t = Hashtbl.create 10
 
-let get_fd = Hashtbl.find used_fd
+let pool_lock = Mutex.create ()
 
-let openfile =
+(* Get an idle connection to the server, or a new one. The boolean tells
+ * whether the connection was reused. *)
+let connect host port =
+  Mutex.lock pool_lock;
+  let idle =
+    try
+      match Hashtbl.find pool (host, port) with
+        | c :: l -> Hashtbl.replace pool (host, port) l; Some c
+        | [] -> None
+    with
+      | Not_found -> None
+  in
+    Mutex.unlock pool_lock;
+    match idle with
+      | Some c -> c, true
+      | None ->
+          let h =
+            try
+              Unix.gethostbyname host
+            with
+              | Not_found -> failwith "Host not found"
+          in
+          let ic, oc = Unix.open_connection (Unix.ADDR_INET((h.Unix.h_addr_list).(0), port)) in
+            { c_ic = ic; c_oc = oc }, false
+
+let disconnect c =
   try
-    let fdcount = ref 0 in
-      fun uri flags mode ->
-        let re_uri = Str.regexp "http://\\([^/]+\\)\\(.*\\)" in
-          if Str.string_match re_uri uri 0 then
-            (
-              let fd = !fdcount in
-              let server = Str.matched_group 1 uri in
-              let path = Str.matched_group 2 uri in
-              let h =
-                try
-                  Unix.gethostbyname server
-                with
-                  | Not_found -> failwith "Host not found"
-              in
-              let ic, oc = Unix.open_connection (Unix.ADDR_INET((h.Unix.h_addr_list).(0), 80)) in
-              let file =
-                {
-                  f_server = server;
-                  f_path = path;
-                  f_pos = 0;
-                  f_ic = ic;
-                  f_oc = oc;
-                  f_len = -1;
-                }
-              in
-              let buf = ref "bla" in
-                output_string oc ("GET " ^ path ^ " HTTP/1.1\n");
-                output_string oc ("Host: " ^ server ^ "\n");
-                output_string oc "\n";
-                flush oc;
-                while !buf <> ""
-                do
-                  buf := input_line ic;
-                  let len = String.length !buf in
-                    if !buf.[len - 1] = '\r' then
-                      buf := String.sub !buf 0 (len - 1);
-                    (
-                      try
-                        Scanf.sscanf !buf "Content-Length: %d" (fun l -> file.f_len <- l);
-                      with
-                        | _ -> ()
-                    );
-                done;
-                incr fdcount;
-                Hashtbl.add used_fd fd file;
-                fd
-            )
-          else
-            raise Fetch.Bad_URI
+    Unix.shutdown_connection c.c_ic;
+    close_in c.c_ic
   with
-    | e -> raise (Fetch.Error e)
+    | _ -> ()
+
+(* Give back the connection of a file, which is kept for later requests when
+ * its response was completely read. *)
+let release f =
+  match f.f_conn with
+    | None -> ()
+    | Some c ->
+        Mutex.lock pool_lock;
+        let idle = try Hashtbl.find pool (f.f_host, f.f_port) with Not_found -> [] in
+        let keep = f.f_body = No_body && f.f_keep_alive && List.length idle < max_idle in
+          if keep then
+            Hashtbl.replace pool (f.f_host, f.f_port) (c :: idle);
+          Mutex.unlock pool_lock;
+          if not keep then
+            disconnect c;
+          f.f_conn <- None
+
+let input_line ic =
+  let l = input_line ic in
+  let len = String.length l in
+    if len > 0 && l.[len - 1] = '\r' then
+      String.sub l 0 (len - 1)
+    else
+      l
+
+(* Remove the blanks around a header value. *)
+let trim s =
+  let is_blank c = c = ' ' || c = '\t' in
+  let len = String.length s in
+  let i = ref 0 in
+  let j = ref len in
+    while !i < len && is_blank s.[!i] do incr i done;
+    while !j > !i && is_blank s.[!j - 1] do decr j done;
+    String.sub s !i (!j - !i)
+
+let get_conn f =
+  match f.f_conn with
+    | Some c -> c
+    | None -> assert false
+
+let rec read_body f buf ofs len =
+  let ic = (get_conn f).c_ic in
+    match f.f_body with
+      | _ when len = 0 -> 0
+      | No_body -> 0
+      | Length l ->
+          let n = input ic buf ofs (min len l) in
+            if n = 0 && l > 0 then
+              raise End_of_file;
+            f.f_body <- if n = l then No_body else Length (l - n);
+            n
+      | Chunked 0 ->
+          let size = Scanf.sscanf (input_line ic) "%x" (fun n -> n) in
+            if size = 0 then
+              (
+                (* Trailers. *)
+                while input_line ic <> "" do () done;
+                f.f_body <- No_body;
+                0
+              )
+            else
+              (
+                f.f_body <- Chunked size;
+                read_body f buf ofs len
+              )
+      | Chunked l ->
+          let n = input ic buf ofs (min len l) in
+            if n = 0 then
+              raise End_of_file;
+            if n = l then
+              ignore (input_line ic);
+            f.f_body <- Chunked (l - n);
+            n
+      | Until_eof ->
+          let n = input ic buf ofs len in
+            if n = 0 then
+              f.f_body <- No_body;
+            n
+
+(* Drop [n] bytes of the body, returns the number of bytes actually
+ * dropped. *)
+let skip_body f n =
+  let buf = String.create (min n 4096) in
+  let rec skip n =
+    if n <= 0 then 0 else
+      let r = read_body f buf 0 (min n (String.length buf)) in
+        if r = 0 then 0 else r + skip (n - r)
+  in
+    skip n
+
+(* Issue a request for the file, starting at the current position. *)
+let rec request ?(retry=true) f =
+  let c, reused = connect f.f_host f.f_port in
+  (* Values are trimmed, [h] includes the colon. *)
+  let header h l =
+    let n = String.length h in
+      if String.length l > n && String.lowercase (String.sub l 0 n) = h then
+        Some (trim (Str.string_after l n))
+      else
+        None
+  in
+  let status =
+    try
+      output_string c.c_oc ("GET " ^ f.f_path ^ " HTTP/1.1\r\n");
+      output_string c.c_oc ("Host: " ^ f.f_host ^ (if f.f_port = 80 then "" else ":" ^ string_of_int f.f_port) ^ "\r\n");
+      if f.f_pos > 0 then
+        output_string c.c_oc (Printf.sprintf "Range: bytes=%d-\r\n" f.f_pos);
+      output_string c.c_oc "\r\n";
+      flush c.c_oc;
+      Some (input_line c.c_ic)
+    with
+      | (End_of_file | Sys_error _) when reused && retry ->
+          (* The server closed the idle connection. *)
+          disconnect c;
+          None
+  in
+    match status with
+      | None -> request ~retry:false f
+      | Some status ->
+          let version, code = Scanf.sscanf status "HTTP/%s %d" (fun v c -> v, c) in
+          let len = ref (-1) in
+          let total = ref (-1) in
+          let chunked = ref false in
+          let keep_alive = ref (version <> "1.0") in
+          let l = ref (input_line c.c_ic) in
+            while !l <> "" do
+              (
+                match header "content-length:" !l with
+                  | Some v -> len := Scanf.sscanf v "%d" (fun n -> n)
+                  | None -> ()
+              );
+              (
+                match header "content-range:" !l with
+                  | Some v ->
+                      (
+                        try
+                          total := Scanf.sscanf v "bytes %d-%d/%d" (fun _ _ n -> n)
+                        with
+                          | _ -> ()
+                      )
+                  | None -> ()
+              );
+              (
+                match header "transfer-encoding:" !l with
+                  | Some v -> chunked := String.lowercase v <> "identity"
+                  | None -> ()
+              );
+              (
+                match header "connection:" !l with
+                  | Some v ->
+                      let v = String.lowercase v in
+                        if v = "close" then keep_alive := false
+                        else if v = "keep-alive" then keep_alive := true
+                  | None -> ()
+              );
+              l := input_line c.c_ic
+            done;
+            f.f_conn <- Some c;
+            f.f_keep_alive <- !keep_alive;
+            f.f_body <-
+              if !chunked then Chunked 0
+              else if !len >= 0 then Length !len
+              else (f.f_keep_alive <- false; Until_eof);
+            if f.f_body = Length 0 then
+              f.f_body <- No_body;
+            match code with
+              | 206 ->
+                  if !total >= 0 then f.f_len <- !total
+              | 200 ->
+                  if !len >= 0 then f.f_len <- !len;
+                  (* The server does not support ranges. *)
+                  ignore (skip_body f f.f_pos)
+              | 416 ->
+                  (* Requested position is after the end of the file. *)
+                  ignore (skip_body f max_int)
+              | _ ->
+                  f.f_keep_alive <- false;
+                  release f;
+                  failwith (Printf.sprintf "HTTP error: %s" status)
+
+(* No request is issued until the file is read, or its length is needed. *)
+let openfile uri flags mode =
+  let re_uri = Str.regexp "http://\\([^/:]+\\)\\(:\\([0-9]+\\)\\)?\\(.*\\)" in
+    if not (Str.string_match re_uri uri 0) then
+      raise Fetch.Bad_URI;
+    try
+      let path = Str.matched_group 4 uri in
+      let file =
+        {
+          f_host = Str.matched_group 1 uri;
+          f_port = (try int_of_string (Str.matched_group 3 uri) with Not_found -> 80);
+          f_path = if path = "" then "/" else path;
+          f_pos = 0;
+          f_conn = None;
+          f_body = No_body;
+          f_keep_alive = false;
+          f_len = -1;
+        }
+      in
+        Proto.add_fd used_fd file
+    with
+      | e -> raise (Fetch.Error e)
 
 let read fd buf ofs len =
-  input (get_fd fd).f_ic buf ofs len
+  let f = get_fd fd in
+    try
+      if f.f_conn = None && (f.f_len < 0 || f.f_pos < f.f_len) then
+        request f;
+      if f.f_conn = None then 0 else
+        let n = read_body f buf ofs len in
+          f.f_pos <- f.f_pos + n;
+          if f.f_body = No_body then
+            release f;
+          n
+    with
+      | e ->
+          f.f_keep_alive <- false;
+          release f;
+          raise (Fetch.Error e)
 
 let close fd =
-  Unix.shutdown_connection (get_fd fd).f_ic;
-  Hashtbl.remove used_fd fd
+  release (get_fd fd);
+  Proto.remove_fd used_fd fd
 
 let lseek fd offs flag =
+  let f = get_fd fd in
   let new_pos =
     match flag with
       | Proto.SEEK_SET -> offs
-      | Proto.SEEK_CUR -> (get_fd fd).f_pos + offs
-      | Proto.SEEK_END -> (get_fd fd).f_len
+      | Proto.SEEK_CUR -> f.f_pos + offs
+      | Proto.SEEK_END ->
+          (* The length is only known from a response. *)
+          if f.f_len < 0 && f.f_conn = None then
+            (
+              try
+                request f
+              with
+                | e -> raise (Fetch.Error e)
+            );
+          if f.f_len < 0 then raise Fetch.Not_implemented;
+          f.f_len + offs
   in
-    (get_fd fd).f_pos <- new_pos; new_pos
-
+    if new_pos < 0 then
+      invalid_arg "Http_fetch.lseek";
+    if new_pos <> f.f_pos then
+      (
+        let skipped =
+          if f.f_conn <> None && new_pos > f.f_pos && new_pos - f.f_pos <= skip_threshold then
+            (
+              try
+                skip_body f (new_pos - f.f_pos)
+              with
+                | _ -> f.f_keep_alive <- false; 0
+            )
+          else
+            0
+        in
+          if f.f_pos + skipped <> new_pos || f.f_body = No_body then
+            release f;
+          f.f_pos <- new_pos
+      );
+    new_pos
 let write _ _ _ _ =
   raise Fetch.Not_implemented
 
@@ -133,4 +383,5 @@ let () =
       Proto.write = write;
       Proto.ls = ls;
       Proto.is_alive = is_alive;
+      Proto.cp = None;
     }
@@ -57,8 +57,44 @@ type io =
       write : int -> string -> int -> int -> int;
       ls : string -> (string * file_kind) list;
       is_alive : string -> bool;
+      cp : (string -> string -> unit) option; (** native copy between two files
+                                                * of the protocol *)
     }
 
+(** Descriptor tables of the backends. Files can be opened and closed by
+  * several threads at once: the lock is only held while the table itself is
+  * accessed, not during the backend operations. *)
+type 'a fd_table =
+    {
+      fd_lock : Mutex.t;
+      fd_files : (int, 'a) Hashtbl.t;
+      mutable fd_count : int;
+    }
+
+let fd_table () =
+  { fd_lock = Mutex.create (); fd_files = Hashtbl.create 10; fd_count = 0 }
+
+let with_fd_table t f =
+  Mutex.lock t.fd_lock;
+  try
+    let ans = f t.fd_files in
+      Mutex.unlock t.fd_lock;
+      ans
+  with e -> Mutex.unlock t.fd_lock; raise e
+
+(** Add a file to the table, returning its descriptor. *)
+let add_fd t file =
+  with_fd_table t
+    (fun h ->
+       let fd = t.fd_count in
+         t.fd_count <- fd + 1;
+         Hashtbl.add h fd file;
+         fd)
+
+let find_fd t fd = with_fd_table t (fun h -> Hashtbl.find h fd)
+
+let remove_fd t fd = with_fd_table t (fun h -> Hashtbl.remove h fd)
+
 module Map = Map.Make(String)
 let protos : io Map.t ref = ref Map.empty
 
@@ -26,51 +26,57 @@
 
 (* $Id$ *)
 
-let hashsize = 10
-
-let used_fd : (int, Smbclient.file_descr) Hashtbl.t = Hashtbl.create hashsize
+let used_fd : Smbclient.file_descr Proto.fd_table = Proto.fd_table ()
 
 let my_flag = function
   | Proto.O_RDONLY -> Smbclient.O_RDONLY
   | Proto.O_WRONLY -> Smbclient.O_WRONLY
-  | _ -> raise Fetch.Not_implemented
+  | Proto.O_RDWR -> Smbclient.O_RDWR
+  | Proto.O_CREAT -> Smbclient.O_CREAT
+  | Proto.O_TRUNC -> Smbclient.O_TRUNC
 
 let my_command = function
   | Proto.SEEK_SET -> Smbclient.SEEK_SET
   | Proto.SEEK_CUR -> Smbclient.SEEK_CUR
   | Proto.SEEK_END -> Smbclient.SEEK_END
 
-let openfile =
-  let fdcount = ref 0 in
-    fun uri flags mode ->
-      begin try
-        let file = Smbclient.openfile uri (List.map my_flag flags) mode in
-        let fd = !fdcount in
-          incr fdcount;
-          Hashtbl.add used_fd fd file;
-          fd
-      with Smbclient.Samba_error _ as e -> raise (Fetch.Error e)
-      end
+let openfile uri flags mode =
+  begin try
+    let file = Smbclient.openfile uri (List.map my_flag flags) mode in
+      Proto.add_fd used_fd file
+  with Smbclient.Samba_error _ as e -> raise (Fetch.Error e)
+  end
 
 let close fd =
   begin try
-    Smbclient.close (Hashtbl.find used_fd fd);
-    Hashtbl.remove used_fd fd
+    Smbclient.close (Proto.find_fd used_fd fd);
+    Proto.remove_fd used_fd fd
   with e -> raise (Fetch.Error e)
   end
 
-let read fd =
+(* Smbclient.read is limited to 16 KiB per call, reads go through a bigarray
+ * so that large blocks are requested at once. *)
+let read fd buf ofs len =
+  if ofs < 0 || len < 0 || ofs > String.length buf - len then
+    invalid_arg "Smb_fetch.read";
   try
-    Smbclient.read (Hashtbl.find used_fd fd)
+    let ba = Bigarray.Array1.create Bigarray.char Bigarray.c_layout len in
+    let n = Smbclient.read_bigarray (Proto.find_fd used_fd fd) ba 0 len in
+      for i = 0 to n - 1 do
+        buf.[ofs + i] <- ba.{i}
+      done;
+      n
   with e -> raise (Fetch.Error e)
 
 let lseek fd offset command =
   try
-    Smbclient.lseek (Hashtbl.find used_fd fd) offset (my_command command)
+    Smbclient.lseek (Proto.find_fd used_fd fd) offset (my_command command)
   with e -> raise (Fetch.Error e)
 
 let write fd =
-  raise Fetch.Not_implemented
+  try
+    Smbclient.write (Proto.find_fd used_fd fd)
+  with e -> raise (Fetch.Error e)
 
 let ls uri =
   begin try
@@ -102,7 +108,10 @@ let ls uri =
     | e -> raise (Fetch.Error e)
   end
 
-let is_alive = fun _ -> false
+let is_alive uri =
+  try
+    Smbclient.is_avail uri
+  with e -> raise (Fetch.Error e)
 
 let () =
   Smbclient.default_init();
@@ -115,4 +124,5 @@ let () =
       Proto.write = write;
       Proto.ls = ls;
       Proto.is_alive = is_alive;
+      Proto.cp = None;
     }
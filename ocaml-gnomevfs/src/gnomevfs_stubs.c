@@ -1,7 +1,12 @@
 /* $Id$ */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 #include <caml/mlvalues.h>
 #include <caml/alloc.h>
@@ -9,14 +14,18 @@
 #include <caml/custom.h>
 #include <caml/memory.h>
 #include <caml/callback.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
 
 #include <libgnomevfs/gnome-vfs.h>
 
 #define UNIX_BUFFER_SIZE 16384
 
-static inline void init() {
+CAMLprim value ocaml_gnomevfs_init(value unit)
+{
 	if (!gnome_vfs_initialized() && !gnome_vfs_init())
-		exit(1);
+		caml_failwith("Gnomevfs: cannot initialize GnomeVFS");
+	return Val_unit;
 }
 
 static value * gnomevfs_error_exn = NULL;
@@ -41,6 +50,197 @@ CAMLprim value ocaml_gnomevfs_error_msg(value result)
 	CAMLreturn(copy_string(gnome_vfs_result_to_string(Int_val(result)+1)));
 }
 
+/* File handles are custom blocks pointing to a handle_t, which is allocated
+ * outside of the OCaml heap so that it can be used in blocking sections. The
+ * GnomeVFS handle is closed when the block is collected, unless [close] was
+ * called before (in which case it is NULL).
+ *
+ * An optional read buffer can be attached to the handle: buf_pos and buf_len
+ * delimit the data which was read from the file but not yet returned. The
+ * position of the underlying handle is thus ahead of the logical position by
+ * Buffered(h) bytes.
+ *
+ * Several threads can use the same handle: the GnomeVFS handle and the buffer
+ * are protected by the mutex, which is only taken in blocking sections so
+ * that a thread waiting for it does not hold the OCaml runtime. */
+typedef struct {
+	GMutex *mutex;
+	GnomeVFSHandle *handle;
+	gchar *buf;
+	GnomeVFSFileSize buf_size;
+	GnomeVFSFileSize buf_pos;
+	GnomeVFSFileSize buf_len;
+} handle_t;
+
+#define Handle_val(v) (*((handle_t **)Data_custom_val(v)))
+
+#define Buffered(h) ((h)->buf_len - (h)->buf_pos)
+
+/* Lock the handle, returning NOT_OPEN if it was closed. The mutex has to be
+ * released with handle_unlock in any case. */
+static GnomeVFSResult handle_lock(handle_t *h)
+{
+	g_mutex_lock(h->mutex);
+	return h->handle ? GNOME_VFS_OK : GNOME_VFS_ERROR_NOT_OPEN;
+}
+
+#define handle_unlock(h) g_mutex_unlock((h)->mutex)
+
+static void handle_free(handle_t *h)
+{
+	if (h->handle)
+		gnome_vfs_close(h->handle);
+	free(h->buf);
+	g_mutex_free(h->mutex);
+	free(h);
+}
+
+static gpointer handle_close_thread(gpointer data)
+{
+	handle_free(data);
+	return NULL;
+}
+
+/* Closing may wait for the network, which must not be done from the GC with
+ * the runtime held: the handle is closed by a short-lived thread, or here
+ * only if none can be created. No other thread can be using it. */
+static void finalize_handle(value handle_)
+{
+	handle_t *h = Handle_val(handle_);
+
+	if (!h->handle || !g_thread_create(handle_close_thread, h, FALSE, NULL))
+		handle_free(h);
+}
+
+static struct custom_operations handle_ops =
+{
+	"ocaml_gnomevfs_handle",
+	finalize_handle,
+	custom_compare_default,
+	custom_hash_default,
+	custom_serialize_default,
+	custom_deserialize_default
+};
+
+static value value_of_handle(GnomeVFSHandle *handle)
+{
+	handle_t *h = malloc(sizeof(handle_t));
+	value ans;
+
+	if (!h) {
+		gnome_vfs_close(handle);
+		caml_raise_out_of_memory();
+	}
+	h->mutex = g_mutex_new();
+	h->handle = handle;
+	h->buf = NULL;
+	h->buf_size = 0;
+	h->buf_pos = 0;
+	h->buf_len = 0;
+	ans = caml_alloc_custom(&handle_ops, sizeof(handle_t *), 0, 1);
+	Handle_val(ans) = h;
+	return ans;
+}
+
+/* Empty the read buffer, moving the underlying handle back to the logical
+ * position. Does not use the OCaml runtime, the handle must be locked. */
+static GnomeVFSResult drop_buffer(handle_t *h)
+{
+	GnomeVFSFileOffset unread = Buffered(h);
+
+	h->buf_pos = 0;
+	h->buf_len = 0;
+	if (unread == 0)
+		return GNOME_VFS_OK;
+	return gnome_vfs_seek(h->handle, GNOME_VFS_SEEK_CURRENT, -unread);
+}
+
+/* Same for directory handles, which have no buffer. */
+#define Dir_handle_val(v) (*((GnomeVFSDirectoryHandle **)Data_custom_val(v)))
+
+static gpointer dir_handle_close_thread(gpointer data)
+{
+	gnome_vfs_directory_close(data);
+	return NULL;
+}
+
+/* Closed by a short-lived thread too, as remote methods may block. */
+static void finalize_dir_handle(value handle_)
+{
+	GnomeVFSDirectoryHandle *handle = Dir_handle_val(handle_);
+
+	if (handle && !g_thread_create(dir_handle_close_thread, handle, FALSE, NULL))
+		gnome_vfs_directory_close(handle);
+}
+
+static struct custom_operations dir_handle_ops =
+{
+	"ocaml_gnomevfs_dir_handle",
+	finalize_dir_handle,
+	custom_compare_default,
+	custom_hash_default,
+	custom_serialize_default,
+	custom_deserialize_default
+};
+
+static value value_of_dir_handle(GnomeVFSDirectoryHandle *handle)
+{
+	value ans = caml_alloc_custom(&dir_handle_ops, sizeof(GnomeVFSDirectoryHandle *), 0, 1);
+	Dir_handle_val(ans) = handle;
+	return ans;
+}
+
+static GnomeVFSDirectoryHandle *dir_handle_of_value(value handle_)
+{
+	GnomeVFSDirectoryHandle *handle = Dir_handle_val(handle_);
+
+	if (!handle)
+		ocaml_gnomevfs_error(GNOME_VFS_ERROR_NOT_OPEN);
+	return handle;
+}
+
+/* Parsed URIs, which can be used in blocking sections as they are outside
+ * of the OCaml heap. */
+#define Uri_val(v) (*((GnomeVFSURI **)Data_custom_val(v)))
+
+static void finalize_uri(value uri_)
+{
+	gnome_vfs_uri_unref(Uri_val(uri_));
+}
+
+static struct custom_operations uri_ops =
+{
+	"ocaml_gnomevfs_uri",
+	finalize_uri,
+	custom_compare_default,
+	custom_hash_default,
+	custom_serialize_default,
+	custom_deserialize_default
+};
+
+CAMLprim value ocaml_gnomevfs_uri_of_string(value uri_)
+{
+	CAMLparam1(uri_);
+	CAMLlocal1(ans);
+	GnomeVFSURI *uri = gnome_vfs_uri_new(String_val(uri_));
+
+	if (!uri) ocaml_gnomevfs_error(GNOME_VFS_ERROR_INVALID_URI);
+	ans = caml_alloc_custom(&uri_ops, sizeof(GnomeVFSURI *), 1, 1000);
+	Uri_val(ans) = uri;
+	CAMLreturn(ans);
+}
+
+CAMLprim value ocaml_gnomevfs_uri_to_string(value uri_)
+{
+	CAMLparam1(uri_);
+	CAMLlocal1(ans);
+	gchar *uri = gnome_vfs_uri_to_string(Uri_val(uri_), GNOME_VFS_URI_HIDE_NONE);
+
+	ans = caml_copy_string(uri);
+	g_free(uri);
+	CAMLreturn(ans);
+}
+
 static GnomeVFSOpenMode ocaml_gnomevfs_open_modes[] = { GNOME_VFS_OPEN_READ, GNOME_VFS_OPEN_WRITE, GNOME_VFS_OPEN_RANDOM };
 
 static GnomeVFSOpenMode ocaml_gnomevfs_mode_of_list (value list)
@@ -53,117 +253,103 @@ static GnomeVFSOpenMode ocaml_gnomevfs_mode_of_list (value list)
 	return res;
 }
 
-CAMLprim value ocaml_gnomevfs_open(value uri_, value mode_)
+CAMLprim value ocaml_gnomevfs_open_uri(value uri_, value mode_)
 {
 	CAMLparam2(uri_, mode_);
 	GnomeVFSHandle *handle;
 	GnomeVFSResult result;
-	GnomeVFSOpenMode mode;
-	char * uri = malloc(caml_string_length(uri_) + 1);
-	uri = strcpy(uri, String_val(uri_));
-	mode = ocaml_gnomevfs_mode_of_list(mode_);
-	init();
+	GnomeVFSURI *uri = Uri_val(uri_);
+	GnomeVFSOpenMode mode = ocaml_gnomevfs_mode_of_list(mode_);
 
 	caml_enter_blocking_section();
-	result = gnome_vfs_open(&handle, uri, mode);
+	result = gnome_vfs_open_uri(&handle, uri, mode);
 	caml_leave_blocking_section();
 
-	free(uri);
 	if (result) ocaml_gnomevfs_error(result);
-	CAMLreturn((value)handle);
+	CAMLreturn(value_of_handle(handle));
 }
 
-CAMLprim value ocaml_gnomevfs_create(value uri_, value mode_, value excl_, value perm_)
+CAMLprim value ocaml_gnomevfs_create_uri(value uri_, value mode_, value excl_, value perm_)
 {
 	CAMLparam4(uri_, mode_, excl_, perm_);
 	GnomeVFSHandle *handle;
 	GnomeVFSResult result;
-	char *uri = malloc(caml_string_length(uri_) + 1);
+	GnomeVFSURI *uri = Uri_val(uri_);
 	GnomeVFSOpenMode mode = ocaml_gnomevfs_mode_of_list(mode_);
 	guint perm = Int_val(perm_);
 	gboolean excl = Bool_val(excl_);
-	uri = strcpy(uri, String_val(uri_));
-	init();
 
 	caml_enter_blocking_section();
-	result = gnome_vfs_create(&handle, uri, mode, excl, perm);
+	result = gnome_vfs_create_uri(&handle, uri, mode, excl, perm);
 	caml_leave_blocking_section();
 
-	free(uri);
 	if (result) ocaml_gnomevfs_error(result);
-	CAMLreturn((value)handle);
+	CAMLreturn(value_of_handle(handle));
 }
 
 CAMLprim value ocaml_gnomevfs_close(value handle_)
 {
 	CAMLparam1(handle_);
 	GnomeVFSResult result;
-	GnomeVFSHandle *handle = (GnomeVFSHandle *)handle_;
-	init();
+	handle_t *h = Handle_val(handle_);
 
 	caml_enter_blocking_section();
-	result = gnome_vfs_close(handle);
+	result = handle_lock(h);
+	if (!result) {
+		result = gnome_vfs_close(h->handle);
+		h->handle = NULL;
+		h->buf_pos = 0;
+		h->buf_len = 0;
+	}
+	handle_unlock(h);
 	caml_leave_blocking_section();
 
 	if (result) ocaml_gnomevfs_error(result);
 	CAMLreturn(Val_unit);
 }
 
-CAMLprim value ocaml_gnomevfs_unlink(value uri_)
+CAMLprim value ocaml_gnomevfs_unlink_from_uri(value uri_)
 {
 	CAMLparam1(uri_);
 	GnomeVFSResult result;
-	char *uri = malloc(caml_string_length(uri_) + 1);
-	uri = strcpy(uri, String_val(uri_));
-	init();
+	GnomeVFSURI *uri = Uri_val(uri_);
 
 	caml_enter_blocking_section();
-	result = gnome_vfs_unlink(uri);
+	result = gnome_vfs_unlink_from_uri(uri);
 	caml_leave_blocking_section();
 
-	free(uri);
 	if (result) ocaml_gnomevfs_error(result);
 	CAMLreturn(Val_unit);
 }
 
-CAMLprim value ocaml_gnomevfs_move(value old_, value new_, value force_)
+CAMLprim value ocaml_gnomevfs_move_uri(value old_, value new_, value force_)
 {
 	CAMLparam3(old_, new_, force_);
 	GnomeVFSResult result;
-	gchar *old = malloc(caml_string_length(old_) + 1);
-	gchar *new = malloc(caml_string_length(new_) + 1);
+	GnomeVFSURI *old = Uri_val(old_);
+	GnomeVFSURI *new = Uri_val(new_);
 	gboolean force = Bool_val(force_);
-	old = strcpy(old, String_val(old_));
-	new = strcpy(new, String_val(new_));
-	init();
 
 	caml_enter_blocking_section();
-	result = gnome_vfs_move(old, new, force);
+	result = gnome_vfs_move_uri(old, new, force);
 	caml_leave_blocking_section();
 
-	free(old);
-	free(new);
 	if (result) ocaml_gnomevfs_error(result);
 	CAMLreturn(Val_unit);
 }
 
-CAMLprim value ocaml_gnomevfs_check_same_fs(value source_, value target_)
+CAMLprim value ocaml_gnomevfs_check_same_fs_uris(value source_, value target_)
 {
 	CAMLparam2(source_, target_);
 	GnomeVFSResult result;
 	gboolean same_fs;
-	gchar *source = malloc(caml_string_length(source_) + 1);
-	gchar *target = malloc(caml_string_length(target_) + 1);
-	source = strcpy(source, String_val(source_));
-	target = strcpy(target, String_val(target_));
-	init();
+	GnomeVFSURI *source = Uri_val(source_);
+	GnomeVFSURI *target = Uri_val(target_);
 
 	caml_enter_blocking_section();
-	result = gnome_vfs_check_same_fs(source, target, &same_fs);
+	result = gnome_vfs_check_same_fs_uris(source, target, &same_fs);
 	caml_leave_blocking_section();
 
-	free(source);
-	free(target);
 	if (result) ocaml_gnomevfs_error(result);
 	CAMLreturn(Val_bool(same_fs));
 }
@@ -173,14 +359,28 @@ CAMLprim value ocaml_gnomevfs_read(value handle_, value buf_, value ofs_, value
 	CAMLparam4(handle_, buf_, ofs_, len_);
 	GnomeVFSResult result;
 	GnomeVFSFileSize bytes_read;
-	GnomeVFSHandle *handle = (GnomeVFSHandle *)handle_;
+	handle_t *h = Handle_val(handle_);
 	gchar buf[UNIX_BUFFER_SIZE];
 	GnomeVFSFileSize len = Long_val(len_);
 	if (len > UNIX_BUFFER_SIZE) len = UNIX_BUFFER_SIZE;
-	init();
 
+	/* Buffered data goes through buf too, as the string can only be
+	 * written once the runtime is held again. */
 	caml_enter_blocking_section();
-	result = gnome_vfs_read(handle, buf, len, &bytes_read);
+	result = handle_lock(h);
+	if (!result && !h->buf)
+		result = gnome_vfs_read(h->handle, buf, len, &bytes_read);
+	else if (!result) {
+		if (Buffered(h) == 0) {
+			result = gnome_vfs_read(h->handle, h->buf, h->buf_size, &bytes_read);
+			h->buf_pos = 0;
+			h->buf_len = result ? 0 : bytes_read;
+		}
+		bytes_read = Buffered(h) < len ? Buffered(h) : len;
+		memcpy(buf, h->buf + h->buf_pos, bytes_read);
+		h->buf_pos += bytes_read;
+	}
+	handle_unlock(h);
 	caml_leave_blocking_section();
 
 	if (result) ocaml_gnomevfs_error(result);
@@ -193,34 +393,139 @@ CAMLprim value ocaml_gnomevfs_write(value handle_, value buf_, value ofs_, value
 	CAMLparam4(handle_, buf_, ofs_, len_);
 	GnomeVFSResult result;
 	GnomeVFSFileSize bytes_written;
-	GnomeVFSHandle *handle = (GnomeVFSHandle *)handle_;
+	handle_t *h = Handle_val(handle_);
 	gchar buf[UNIX_BUFFER_SIZE];
 	GnomeVFSFileSize len = Long_val(len_);
 	if (len > UNIX_BUFFER_SIZE) len = UNIX_BUFFER_SIZE;
-	init();
 	memmove(buf, &Byte(buf_, Long_val(ofs_)), len);
 
 	caml_enter_blocking_section();
-	result = gnome_vfs_write(handle, buf, len, &bytes_written);
+	result = handle_lock(h);
+	if (!result)
+		result = drop_buffer(h);
+	if (!result)
+		result = gnome_vfs_write(h->handle, buf, len, &bytes_written);
+	handle_unlock(h);
 	caml_leave_blocking_section();
 
 	if (result) ocaml_gnomevfs_error(result);
 	CAMLreturn(Val_int(bytes_written));
 }
 
+/* Read directly into the bigarray, until len bytes are read or the end of the
+ * file is reached. */
+CAMLprim value ocaml_gnomevfs_read_ba(value handle_, value buf_, value ofs_, value len_)
+{
+	CAMLparam4(handle_, buf_, ofs_, len_);
+	GnomeVFSResult result = GNOME_VFS_OK;
+	GnomeVFSFileSize bytes_read;
+	GnomeVFSFileSize total = 0;
+	handle_t *h = Handle_val(handle_);
+	gchar *buf = (gchar *)Caml_ba_data_val(buf_) + Long_val(ofs_);
+	GnomeVFSFileSize len = Long_val(len_);
+
+	caml_enter_blocking_section();
+	result = handle_lock(h);
+	if (!result && Buffered(h) > 0) {
+		total = Buffered(h) < len ? Buffered(h) : len;
+		memcpy(buf, h->buf + h->buf_pos, total);
+		h->buf_pos += total;
+	}
+	while (!result && total < len) {
+		result = gnome_vfs_read(h->handle, buf + total, len - total, &bytes_read);
+		if (result || bytes_read == 0) break;
+		total += bytes_read;
+	}
+	handle_unlock(h);
+	caml_leave_blocking_section();
+
+	if (result && total == 0) ocaml_gnomevfs_error(result);
+	if (total > Max_long) ocaml_gnomevfs_error(GNOME_VFS_ERROR_TOO_BIG);
+	CAMLreturn(Val_long(total));
+}
+
+CAMLprim value ocaml_gnomevfs_write_ba(value handle_, value buf_, value ofs_, value len_)
+{
+	CAMLparam4(handle_, buf_, ofs_, len_);
+	GnomeVFSResult result;
+	GnomeVFSFileSize bytes_written;
+	GnomeVFSFileSize total = 0;
+	handle_t *h = Handle_val(handle_);
+	gchar *buf = (gchar *)Caml_ba_data_val(buf_) + Long_val(ofs_);
+	GnomeVFSFileSize len = Long_val(len_);
+
+	caml_enter_blocking_section();
+	result = handle_lock(h);
+	if (!result)
+		result = drop_buffer(h);
+	while (!result && total < len) {
+		result = gnome_vfs_write(h->handle, buf + total, len - total, &bytes_written);
+		if (result || bytes_written == 0) break;
+		total += bytes_written;
+	}
+	handle_unlock(h);
+	caml_leave_blocking_section();
+
+	if (result && total == 0) ocaml_gnomevfs_error(result);
+	CAMLreturn(Val_long(total));
+}
+
+CAMLprim value ocaml_gnomevfs_set_read_buffer(value handle_, value size_)
+{
+	CAMLparam2(handle_, size_);
+	GnomeVFSResult result;
+	handle_t *h = Handle_val(handle_);
+	GnomeVFSFileSize size = Long_val(size_);
+	gchar *buf = NULL;
+	gchar *old;
+
+	if (size > 0) {
+		buf = malloc(size);
+		if (!buf) caml_raise_out_of_memory();
+	}
+
+	/* On success, buf is swapped with the previous buffer, which is freed
+	 * in any case. */
+	caml_enter_blocking_section();
+	result = handle_lock(h);
+	if (!result)
+		result = drop_buffer(h);
+	if (!result) {
+		old = h->buf;
+		h->buf = buf;
+		h->buf_size = size;
+		buf = old;
+	}
+	handle_unlock(h);
+	caml_leave_blocking_section();
+
+	free(buf);
+	if (result) ocaml_gnomevfs_error(result);
+	CAMLreturn(Val_unit);
+}
+
 static GnomeVFSSeekPosition ocaml_gnomevfs_seek_positions[] = { GNOME_VFS_SEEK_START, GNOME_VFS_SEEK_CURRENT, GNOME_VFS_SEEK_END };
 
 CAMLprim value ocaml_gnomevfs_seek(value handle_, value whence_, value offset_)
 {
 	CAMLparam3(handle_, whence_, offset_);
 	GnomeVFSResult result;
-	GnomeVFSHandle *handle = (GnomeVFSHandle *)handle_;
+	handle_t *h = Handle_val(handle_);
 	GnomeVFSSeekPosition whence = ocaml_gnomevfs_seek_positions[Int_val(whence_)];
 	GnomeVFSFileOffset offset = Long_val(offset_);
-	init();
 
+	/* The buffered data is dropped, relative seeks are from the logical
+	 * position. */
 	caml_enter_blocking_section();
-	result = gnome_vfs_seek(handle, whence, offset);
+	result = handle_lock(h);
+	if (!result) {
+		if (whence == GNOME_VFS_SEEK_CURRENT)
+			offset -= Buffered(h);
+		h->buf_pos = 0;
+		h->buf_len = 0;
+		result = gnome_vfs_seek(h->handle, whence, offset);
+	}
+	handle_unlock(h);
 	caml_leave_blocking_section();
 
 	if (result) ocaml_gnomevfs_error(result);
@@ -232,11 +537,15 @@ CAMLprim value ocaml_gnomevfs_tell(value handle_)
 	CAMLparam1(handle_);
 	GnomeVFSResult result;
 	GnomeVFSFileSize offset_return;
-	GnomeVFSHandle *handle = (GnomeVFSHandle *)handle_;
-	init();
+	handle_t *h = Handle_val(handle_);
 
 	caml_enter_blocking_section();
-	result = gnome_vfs_tell(handle, &offset_return);
+	result = handle_lock(h);
+	if (!result)
+		result = gnome_vfs_tell(h->handle, &offset_return);
+	if (!result)
+		offset_return -= Buffered(h);
+	handle_unlock(h);
 	caml_leave_blocking_section();
 
 	if (result) ocaml_gnomevfs_error(result);
@@ -244,72 +553,66 @@ CAMLprim value ocaml_gnomevfs_tell(value handle_)
 	CAMLreturn(Val_long(offset_return));
 }
 
-CAMLprim value ocaml_gnomevfs_make_directory(value uri_, value perm_)
+CAMLprim value ocaml_gnomevfs_make_directory_for_uri(value uri_, value perm_)
 {
 	CAMLparam2(uri_, perm_);
 	GnomeVFSResult result;
-	gchar *uri = malloc(caml_string_length(uri_) + 1);
-	uri = strcpy(uri, String_val(uri_));
-	init();
+	GnomeVFSURI *uri = Uri_val(uri_);
+	guint perm = Int_val(perm_);
 
 	caml_enter_blocking_section();
-	result = gnome_vfs_make_directory(uri, Int_val(perm_));
+	result = gnome_vfs_make_directory_for_uri(uri, perm);
 	caml_leave_blocking_section();
 
-	free(uri);
 	if (result) ocaml_gnomevfs_error(result);
 	CAMLreturn(Val_unit);
 }
 
-CAMLprim value ocaml_gnomevfs_remove_directory(value uri_)
+CAMLprim value ocaml_gnomevfs_remove_directory_from_uri(value uri_)
 {
 	CAMLparam1(uri_);
 	GnomeVFSResult result;
-	gchar *uri = malloc(caml_string_length(uri_) + 1);
-	uri = strcpy(uri, String_val(uri_));
-	init();
+	GnomeVFSURI *uri = Uri_val(uri_);
 
 	caml_enter_blocking_section();
-	result = gnome_vfs_remove_directory(uri);
+	result = gnome_vfs_remove_directory_from_uri(uri);
 	caml_leave_blocking_section();
 
-	free(uri);
 	if (result) ocaml_gnomevfs_error(result);
 	CAMLreturn(Val_unit);
 }
 
-CAMLprim value ocaml_gnomevfs_directory_open(value uri_, value options_)
+CAMLprim value ocaml_gnomevfs_directory_open_from_uri(value uri_, value options_)
 {
 	CAMLparam2(uri_, options_);
 	GnomeVFSResult result;
 	GnomeVFSDirectoryHandle *handle;
-	gchar *uri = malloc(caml_string_length(uri_) + 1);
-	uri = strcpy(uri, String_val(uri_));
-	init();
+	GnomeVFSURI *uri = Uri_val(uri_);
 
 	caml_enter_blocking_section();
-	result = gnome_vfs_directory_open(&handle, uri, GNOME_VFS_FILE_INFO_DEFAULT);
+	result = gnome_vfs_directory_open_from_uri(&handle, uri, GNOME_VFS_FILE_INFO_DEFAULT);
 	caml_leave_blocking_section();
 
-	free(uri);
 	if (result) ocaml_gnomevfs_error(result);
-	CAMLreturn((value)handle);
+	CAMLreturn(value_of_dir_handle(handle));
 }
 
 CAMLprim value ocaml_gnomevfs_directory_read_next(value handle_)
 {
 	CAMLparam1(handle_);
+	GnomeVFSDirectoryHandle *handle = dir_handle_of_value(handle_);
 	GnomeVFSFileInfo *info = gnome_vfs_file_info_new();
 	GnomeVFSResult result;
-	GnomeVFSDirectoryHandle *handle = (GnomeVFSDirectoryHandle *)handle_;
 	CAMLlocal3(info_, symlink_name, mime_type);
-	init();
 
 	caml_enter_blocking_section();
 	result = gnome_vfs_directory_read_next(handle, info);
 	caml_leave_blocking_section();
 
-	if (result) ocaml_gnomevfs_error(result);
+	if (result) {
+		gnome_vfs_file_info_unref(info);
+		ocaml_gnomevfs_error(result);
+	}
 	info_ = caml_alloc_tuple(18);
 	Store_field(info_, 0, caml_copy_string(info->name));
 	Store_field(info_, 1, Val_int(info->valid_fields));
@@ -347,8 +650,8 @@ CAMLprim value ocaml_gnomevfs_directory_close(value handle_)
 {
 	CAMLparam1(handle_);
 	GnomeVFSResult result;
-	GnomeVFSDirectoryHandle *handle = (GnomeVFSDirectoryHandle *)handle_;
-	init();
+	GnomeVFSDirectoryHandle *handle = dir_handle_of_value(handle_);
+	Dir_handle_val(handle_) = NULL;
 
 	caml_enter_blocking_section();
 	result = gnome_vfs_directory_close(handle);
@@ -357,3 +660,730 @@ CAMLprim value ocaml_gnomevfs_directory_close(value handle_)
 	if (result) ocaml_gnomevfs_error(result);
 	CAMLreturn(Val_unit);
 }
+
+static GnomeVFSFileInfoOptions ocaml_gnomevfs_file_info_options[] = { GNOME_VFS_FILE_INFO_GET_MIME_TYPE, GNOME_VFS_FILE_INFO_FORCE_FAST_MIME_TYPE, GNOME_VFS_FILE_INFO_FORCE_SLOW_MIME_TYPE, GNOME_VFS_FILE_INFO_FOLLOW_LINKS, GNOME_VFS_FILE_INFO_GET_ACCESS_RIGHTS, GNOME_VFS_FILE_INFO_NAME_ONLY };
+
+static GnomeVFSFileInfoOptions ocaml_gnomevfs_options_of_list(value list)
+{
+	int res = GNOME_VFS_FILE_INFO_DEFAULT;
+	while (list != Val_int(0)) {
+		res |= ocaml_gnomevfs_file_info_options[Int_val(Field(list, 0))];
+		list = Field(list, 1);
+	}
+	return res;
+}
+
+/* Entries of a directory, stored as one array per field. The arrays of sizes
+ * and times are handed to the bigarrays returned to OCaml. */
+typedef struct {
+	int len;
+	int size;
+	gchar **names;
+	int *types;
+	int64_t *sizes;
+	double *atimes;
+	double *mtimes;
+	double *ctimes;
+} listing_t;
+
+static void listing_free(listing_t *l)
+{
+	int i;
+
+	if (l->names) {
+		for (i = 0; i < l->len; i++)
+			g_free(l->names[i]);
+		free(l->names);
+	}
+	free(l->types);
+	free(l->sizes);
+	free(l->atimes);
+	free(l->mtimes);
+	free(l->ctimes);
+}
+
+/* Make room for one more entry (and the NULL ending names). */
+static int listing_grow(listing_t *l)
+{
+	int size = l->size ? 2 * l->size : 64;
+	void *p;
+
+	if (l->len + 1 < l->size)
+		return 1;
+#define GROW(field) \
+	if (!(p = realloc(l->field, size * sizeof(*(l->field))))) return 0; \
+	l->field = p;
+	GROW(names);
+	GROW(types);
+	GROW(sizes);
+	GROW(atimes);
+	GROW(mtimes);
+	GROW(ctimes);
+#undef GROW
+	l->size = size;
+	return 1;
+}
+
+static GnomeVFSResult listing_load(listing_t *l, GnomeVFSDirectoryHandle *handle)
+{
+	GnomeVFSFileInfo *info = gnome_vfs_file_info_new();
+	GnomeVFSResult result;
+	int i;
+
+	while (!(result = gnome_vfs_directory_read_next(handle, info))) {
+		if (!listing_grow(l)) {
+			result = GNOME_VFS_ERROR_NO_MEMORY;
+			break;
+		}
+		i = l->len++;
+		l->names[i] = g_strdup(info->name);
+		l->types[i] = (info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_TYPE) ? info->type : GNOME_VFS_FILE_TYPE_UNKNOWN;
+		l->sizes[i] = (info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_SIZE) ? (int64_t)info->size : -1;
+		l->atimes[i] = (info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_ATIME) ? (double)info->atime : 0.;
+		l->mtimes[i] = (info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_MTIME) ? (double)info->mtime : 0.;
+		l->ctimes[i] = (info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_CTIME) ? (double)info->ctime : 0.;
+		gnome_vfs_file_info_clear(info);
+	}
+	gnome_vfs_file_info_unref(info);
+
+	if (result == GNOME_VFS_ERROR_EOF)
+		result = listing_grow(l) ? GNOME_VFS_OK : GNOME_VFS_ERROR_NO_MEMORY;
+	if (!result)
+		l->names[l->len] = NULL;
+	return result;
+}
+
+CAMLprim value ocaml_gnomevfs_directory_read_all_from_uri(value uri_, value options_)
+{
+	CAMLparam2(uri_, options_);
+	CAMLlocal3(ans, types, v);
+	GnomeVFSResult result;
+	GnomeVFSDirectoryHandle *handle;
+	GnomeVFSFileInfoOptions options = ocaml_gnomevfs_options_of_list(options_);
+	listing_t l = { 0, 0, NULL, NULL, NULL, NULL, NULL, NULL };
+	GnomeVFSURI *uri = Uri_val(uri_);
+	int i;
+
+	caml_enter_blocking_section();
+	result = gnome_vfs_directory_open_from_uri(&handle, uri, options);
+	if (!result) {
+		result = listing_load(&l, handle);
+		gnome_vfs_directory_close(handle);
+	}
+	caml_leave_blocking_section();
+
+	if (result) {
+		listing_free(&l);
+		ocaml_gnomevfs_error(result);
+	}
+
+	types = caml_alloc(l.len, 0);
+	for (i = 0; i < l.len; i++)
+		Store_field(types, i, Val_int(l.types[i]));
+	ans = caml_alloc_tuple(6);
+	Store_field(ans, 1, types);
+	v = caml_copy_string_array((const char **)l.names);
+	Store_field(ans, 0, v);
+	v = caml_ba_alloc_dims(CAML_BA_INT64 | CAML_BA_C_LAYOUT | CAML_BA_MANAGED, 1, l.sizes, (intnat)l.len);
+	l.sizes = NULL;
+	Store_field(ans, 2, v);
+	v = caml_ba_alloc_dims(CAML_BA_FLOAT64 | CAML_BA_C_LAYOUT | CAML_BA_MANAGED, 1, l.atimes, (intnat)l.len);
+	l.atimes = NULL;
+	Store_field(ans, 3, v);
+	v = caml_ba_alloc_dims(CAML_BA_FLOAT64 | CAML_BA_C_LAYOUT | CAML_BA_MANAGED, 1, l.mtimes, (intnat)l.len);
+	l.mtimes = NULL;
+	Store_field(ans, 4, v);
+	v = caml_ba_alloc_dims(CAML_BA_FLOAT64 | CAML_BA_C_LAYOUT | CAML_BA_MANAGED, 1, l.ctimes, (intnat)l.len);
+	l.ctimes = NULL;
+	Store_field(ans, 5, v);
+	listing_free(&l);
+	CAMLreturn(ans);
+}
+
+/* Transfers. */
+
+static GnomeVFSXferOptions ocaml_gnomevfs_xfer_options[] = { GNOME_VFS_XFER_FOLLOW_LINKS, GNOME_VFS_XFER_RECURSIVE, GNOME_VFS_XFER_SAMEFS, GNOME_VFS_XFER_DELETE_ITEMS, GNOME_VFS_XFER_REMOVESOURCE, GNOME_VFS_XFER_USE_UNIQUE_NAMES };
+
+static GnomeVFSXferOverwriteMode ocaml_gnomevfs_xfer_overwrite_modes[] = { GNOME_VFS_XFER_OVERWRITE_MODE_REPLACE, GNOME_VFS_XFER_OVERWRITE_MODE_ABORT, GNOME_VFS_XFER_OVERWRITE_MODE_SKIP };
+
+static GnomeVFSXferOptions ocaml_gnomevfs_xfer_options_of_list(value list)
+{
+	int res = GNOME_VFS_XFER_DEFAULT;
+	while (list != Val_int(0)) {
+		res |= ocaml_gnomevfs_xfer_options[Int_val(Field(list, 0))];
+		list = Field(list, 1);
+	}
+	return res;
+}
+
+static GList *uri_list_of_value(value list)
+{
+	GList *res = NULL;
+	while (list != Val_int(0)) {
+		res = g_list_prepend(res, Uri_val(Field(list, 0)));
+		list = Field(list, 1);
+	}
+	return g_list_reverse(res);
+}
+
+/* The progress closure and the exception it raised, both registered as
+ * local roots of ocaml_gnomevfs_xfer_uri_list. */
+typedef struct {
+	value *progress;
+	value *exn;
+	double interval;
+	double last;
+} xfer_t;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/* Called by GnomeVFS in the thread running the transfer, outside of the
+ * OCaml runtime. The OCaml closure is called at most every interval seconds
+ * and when the transfer is completed, with immediate arguments only.
+ *
+ * DUPLICATE is reported with XFER_USE_UNIQUE_NAMES, non-zero accepts the
+ * generated name. Errors and overwrites are only queried in modes which are
+ * not used, 0 aborts. */
+static gint xfer_progress(GnomeVFSXferProgressInfo *info, gpointer data)
+{
+	xfer_t *x = data;
+	value args[5];
+	value ret;
+	double t;
+
+	if (*(x->exn) != Val_unit)
+		return 0;
+	if (info->status == GNOME_VFS_XFER_PROGRESS_STATUS_DUPLICATE)
+		return 1;
+	if (info->status != GNOME_VFS_XFER_PROGRESS_STATUS_OK)
+		return 0;
+	if (*(x->progress) == Val_unit)
+		return 1;
+	t = now();
+	if (info->phase != GNOME_VFS_XFER_PHASE_COMPLETED && t - x->last < x->interval)
+		return 1;
+	x->last = t;
+
+	caml_leave_blocking_section();
+	args[0] = Val_int(info->phase);
+	args[1] = Val_long(info->file_index);
+	args[2] = Val_long(info->files_total);
+	args[3] = Val_long(info->total_bytes_copied);
+	args[4] = Val_long(info->bytes_total);
+	ret = caml_callbackN_exn(Field(*(x->progress), 0), 5, args);
+	if (Is_exception_result(ret)) {
+		*(x->exn) = Extract_exception(ret);
+		ret = Val_false;
+	}
+	caml_enter_blocking_section();
+
+	return Bool_val(ret);
+}
+
+CAMLprim value ocaml_gnomevfs_xfer_uri_list(value source_, value target_, value options_, value overwrite_, value progress_, value interval_)
+{
+	CAMLparam5(source_, target_, options_, overwrite_, progress_);
+	CAMLxparam1(interval_);
+	CAMLlocal1(exn);
+	GnomeVFSResult result;
+	GList *source = uri_list_of_value(source_);
+	GList *target = uri_list_of_value(target_);
+	GnomeVFSXferOptions options = ocaml_gnomevfs_xfer_options_of_list(options_);
+	GnomeVFSXferOverwriteMode overwrite = ocaml_gnomevfs_xfer_overwrite_modes[Int_val(overwrite_)];
+	xfer_t x;
+
+	exn = Val_unit;
+	x.progress = &progress_;
+	x.exn = &exn;
+	x.interval = Double_val(interval_);
+	x.last = 0.;
+
+	caml_enter_blocking_section();
+	result = gnome_vfs_xfer_uri_list(source, target, options, GNOME_VFS_XFER_ERROR_MODE_ABORT, overwrite, xfer_progress, &x);
+	caml_leave_blocking_section();
+
+	g_list_free(source);
+	g_list_free(target);
+	if (exn != Val_unit) caml_raise(exn);
+	if (result) ocaml_gnomevfs_error(result);
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_gnomevfs_xfer_uri_list_byte(value *argv, int argc)
+{
+	return ocaml_gnomevfs_xfer_uri_list(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+/* Asynchronous operations.
+ *
+ * All the gnome_vfs_async_* functions are called from a single thread running
+ * the default GLib main loop, in which GnomeVFS also invokes the callbacks.
+ * Requests are handed to this thread with g_idle_add. Callbacks push their
+ * completion on a lock-free stack, which is grabbed at once by
+ * ocaml_gnomevfs_async_poll. A byte is written to a pipe when the stack
+ * becomes non-empty, so that poll can wait for completions.
+ *
+ * The buffers of pending reads and writes, as well as the handles, are kept
+ * alive by the OCaml side until their completion is polled. */
+
+typedef struct {
+	GnomeVFSAsyncHandle *handle;
+	gboolean is_dir;
+} async_t;
+
+#define Async_val(v) (*((async_t **)Data_custom_val(v)))
+
+enum {
+	ASYNC_OPEN,
+	ASYNC_CREATE,
+	ASYNC_READ,
+	ASYNC_WRITE,
+	ASYNC_CLOSE,
+	ASYNC_LOAD_DIRECTORY,
+	ASYNC_RELEASE
+};
+
+typedef struct {
+	int op;
+	long job;
+	async_t *a;
+	GnomeVFSURI *uri;
+	GnomeVFSOpenMode mode;
+	gboolean excl;
+	guint perm;
+	int priority;
+	GnomeVFSFileInfoOptions options;
+	guint items;
+	gpointer buf;
+	guint len;
+} request_t;
+
+/* Constant constructors of Gnomevfs.Async.event, then the tags of the
+ * non-constant ones. */
+enum {
+	EVENT_OPENED,
+	EVENT_CLOSED,
+	EVENT_LOADED
+};
+enum {
+	EVENT_READ,
+	EVENT_WRITTEN,
+	EVENT_ENTRIES,
+	EVENT_ERROR
+};
+
+typedef struct completion {
+	long job;
+	int constant;
+	int tag;
+	GnomeVFSResult result;
+	GnomeVFSFileSize bytes;
+	gchar **names;
+	struct completion *next;
+} completion_t;
+
+static completion_t * volatile completions = NULL;
+static int wakeup[2] = { -1, -1 };
+static long last_job = 0;
+
+static void push_completion(completion_t *c)
+{
+	completion_t *head;
+
+	do {
+		head = completions;
+		c->next = head;
+	} while (!__sync_bool_compare_and_swap(&completions, head, c));
+
+	if (!head)
+		while (write(wakeup[1], "", 1) < 0 && errno == EINTR);
+}
+
+static void complete(long job, int constant, int tag, GnomeVFSResult result, GnomeVFSFileSize bytes, gchar **names)
+{
+	completion_t *c = malloc(sizeof(completion_t));
+
+	if (!c) return;
+	c->job = job;
+	c->constant = constant;
+	c->tag = tag;
+	c->result = result;
+	c->bytes = bytes;
+	c->names = names;
+	push_completion(c);
+}
+
+static void complete_error(long job, GnomeVFSResult result)
+{
+	complete(job, -1, EVENT_ERROR, result, 0, NULL);
+}
+
+static void request_free(request_t *req)
+{
+	if (req->uri) gnome_vfs_uri_unref(req->uri);
+	free(req);
+}
+
+static void async_open_cb(GnomeVFSAsyncHandle *handle, GnomeVFSResult result, gpointer data)
+{
+	request_t *req = data;
+
+	if (result) {
+		req->a->handle = NULL;
+		complete_error(req->job, result);
+	}
+	else
+		complete(req->job, EVENT_OPENED, -1, result, 0, NULL);
+	request_free(req);
+}
+
+static void async_close_cb(GnomeVFSAsyncHandle *handle, GnomeVFSResult result, gpointer data)
+{
+	request_t *req = data;
+
+	if (req->op == ASYNC_RELEASE)
+		free(req->a);
+	else if (result)
+		complete_error(req->job, result);
+	else
+		complete(req->job, EVENT_CLOSED, -1, result, 0, NULL);
+	request_free(req);
+}
+
+static void async_read_cb(GnomeVFSAsyncHandle *handle, GnomeVFSResult result, gpointer buffer, GnomeVFSFileSize bytes_requested, GnomeVFSFileSize bytes_read, gpointer data)
+{
+	request_t *req = data;
+
+	if (result)
+		complete_error(req->job, result);
+	else
+		complete(req->job, -1, EVENT_READ, result, bytes_read, NULL);
+	request_free(req);
+}
+
+static void async_write_cb(GnomeVFSAsyncHandle *handle, GnomeVFSResult result, gconstpointer buffer, GnomeVFSFileSize bytes_requested, GnomeVFSFileSize bytes_written, gpointer data)
+{
+	request_t *req = data;
+
+	if (result)
+		complete_error(req->job, result);
+	else
+		complete(req->job, -1, EVENT_WRITTEN, result, bytes_written, NULL);
+	request_free(req);
+}
+
+static void async_load_directory_cb(GnomeVFSAsyncHandle *handle, GnomeVFSResult result, GList *list, guint entries_read, gpointer data)
+{
+	request_t *req = data;
+	gchar **names;
+	GList *l;
+	guint i = 0;
+
+	if (entries_read > 0) {
+		names = malloc((entries_read + 1) * sizeof(gchar *));
+		if (names) {
+			for (l = list; l && i < entries_read; l = l->next)
+				names[i++] = g_strdup(((GnomeVFSFileInfo *)l->data)->name);
+			names[i] = NULL;
+			complete(req->job, -1, EVENT_ENTRIES, GNOME_VFS_OK, 0, names);
+		}
+	}
+	if (result == GNOME_VFS_OK)
+		return;
+
+	/* This is the last call for this request. */
+	req->a->handle = NULL;
+	if (result == GNOME_VFS_ERROR_EOF)
+		complete(req->job, EVENT_LOADED, -1, result, 0, NULL);
+	else
+		complete_error(req->job, result);
+	request_free(req);
+}
+
+/* Run in the main loop thread. */
+static gboolean async_submit(gpointer data)
+{
+	request_t *req = data;
+	async_t *a = req->a;
+	GnomeVFSAsyncHandle *handle;
+
+	switch (req->op) {
+	case ASYNC_OPEN:
+		gnome_vfs_async_open_uri(&a->handle, req->uri, req->mode, req->priority, async_open_cb, req);
+		break;
+
+	case ASYNC_CREATE:
+		gnome_vfs_async_create_uri(&a->handle, req->uri, req->mode, req->excl, req->perm, req->priority, async_open_cb, req);
+		break;
+
+	case ASYNC_LOAD_DIRECTORY:
+		gnome_vfs_async_load_directory_uri(&a->handle, req->uri, req->options, req->items, req->priority, async_load_directory_cb, req);
+		break;
+
+	case ASYNC_READ:
+	case ASYNC_WRITE:
+	case ASYNC_CLOSE:
+		if (!a->handle) {
+			complete_error(req->job, GNOME_VFS_ERROR_NOT_OPEN);
+			request_free(req);
+		}
+		else if (req->op == ASYNC_READ)
+			gnome_vfs_async_read(a->handle, req->buf, req->len, async_read_cb, req);
+		else if (req->op == ASYNC_WRITE)
+			gnome_vfs_async_write(a->handle, req->buf, req->len, async_write_cb, req);
+		else {
+			handle = a->handle;
+			a->handle = NULL;
+			gnome_vfs_async_close(handle, async_close_cb, req);
+		}
+		break;
+
+	case ASYNC_RELEASE:
+		/* The OCaml handle was collected: close the file if it is still
+		 * open. Directory handles are released by GnomeVFS after their last
+		 * callback. */
+		if (a->handle && !a->is_dir)
+			gnome_vfs_async_close(a->handle, async_close_cb, req);
+		else {
+			free(a);
+			request_free(req);
+		}
+		break;
+	}
+
+	return FALSE;
+}
+
+static gpointer async_loop(gpointer data)
+{
+	GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+
+	g_main_loop_run(loop);
+	return NULL;
+}
+
+/* Called with the OCaml runtime lock held. */
+static void async_start(void)
+{
+	if (wakeup[0] >= 0)
+		return;
+
+	if (pipe(wakeup))
+		caml_failwith("Gnomevfs.Async: cannot create pipe");
+	fcntl(wakeup[0], F_SETFL, fcntl(wakeup[0], F_GETFL) | O_NONBLOCK);
+	if (!g_thread_create(async_loop, NULL, FALSE, NULL))
+		caml_failwith("Gnomevfs.Async: cannot create main loop thread");
+}
+
+static void finalize_async(value a_)
+{
+	request_t *req = calloc(1, sizeof(request_t));
+
+	if (!req) return;
+	req->op = ASYNC_RELEASE;
+	req->a = Async_val(a_);
+	g_idle_add(async_submit, req);
+}
+
+static struct custom_operations async_ops =
+{
+	"ocaml_gnomevfs_async_handle",
+	finalize_async,
+	custom_compare_default,
+	custom_hash_default,
+	custom_serialize_default,
+	custom_deserialize_default
+};
+
+static request_t *request_new(int op)
+{
+	request_t *req = calloc(1, sizeof(request_t));
+
+	if (!req) caml_raise_out_of_memory();
+	req->op = op;
+	req->job = ++last_job;
+	return req;
+}
+
+/* Submit a request on a new handle for the parsed URI uri_, returning
+ * (handle, job). */
+static value async_submit_new(request_t *req, value uri_, gboolean is_dir)
+{
+	CAMLparam1(uri_);
+	CAMLlocal2(ans, a_);
+	async_t *a = malloc(sizeof(async_t));
+
+	if (!a) {
+		request_free(req);
+		caml_raise_out_of_memory();
+	}
+	a->handle = NULL;
+	a->is_dir = is_dir;
+	a_ = caml_alloc_custom(&async_ops, sizeof(async_t *), 0, 1);
+	Async_val(a_) = a;
+	req->a = a;
+	req->uri = gnome_vfs_uri_ref(Uri_val(uri_));
+	g_idle_add(async_submit, req);
+
+	ans = caml_alloc_tuple(2);
+	Store_field(ans, 0, a_);
+	Store_field(ans, 1, Val_long(req->job));
+	CAMLreturn(ans);
+}
+
+CAMLprim value ocaml_gnomevfs_async_open_uri(value uri_, value mode_, value priority_)
+{
+	CAMLparam3(uri_, mode_, priority_);
+	request_t *req;
+	async_start();
+
+	req = request_new(ASYNC_OPEN);
+	req->mode = ocaml_gnomevfs_mode_of_list(mode_);
+	req->priority = Int_val(priority_);
+	CAMLreturn(async_submit_new(req, uri_, FALSE));
+}
+
+CAMLprim value ocaml_gnomevfs_async_create_uri(value uri_, value mode_, value excl_, value perm_, value priority_)
+{
+	CAMLparam5(uri_, mode_, excl_, perm_, priority_);
+	request_t *req;
+	async_start();
+
+	req = request_new(ASYNC_CREATE);
+	req->mode = ocaml_gnomevfs_mode_of_list(mode_);
+	req->excl = Bool_val(excl_);
+	req->perm = Int_val(perm_);
+	req->priority = Int_val(priority_);
+	CAMLreturn(async_submit_new(req, uri_, FALSE));
+}
+
+CAMLprim value ocaml_gnomevfs_async_load_directory_uri(value uri_, value items_, value priority_)
+{
+	CAMLparam3(uri_, items_, priority_);
+	request_t *req;
+	async_start();
+
+	req = request_new(ASYNC_LOAD_DIRECTORY);
+	req->options = GNOME_VFS_FILE_INFO_DEFAULT;
+	req->items = Int_val(items_);
+	req->priority = Int_val(priority_);
+	CAMLreturn(async_submit_new(req, uri_, TRUE));
+}
+
+static value async_submit_io(int op, value a_, value buf_, value ofs_, value len_)
+{
+	request_t *req;
+	async_start();
+
+	req = request_new(op);
+	req->a = Async_val(a_);
+	if (buf_ != Val_unit) {
+		req->buf = (gchar *)Caml_ba_data_val(buf_) + Long_val(ofs_);
+		req->len = Long_val(len_) > G_MAXUINT ? G_MAXUINT : Long_val(len_);
+	}
+	g_idle_add(async_submit, req);
+	return Val_long(req->job);
+}
+
+CAMLprim value ocaml_gnomevfs_async_read(value a_, value buf_, value ofs_, value len_)
+{
+	CAMLparam4(a_, buf_, ofs_, len_);
+	CAMLreturn(async_submit_io(ASYNC_READ, a_, buf_, ofs_, len_));
+}
+
+CAMLprim value ocaml_gnomevfs_async_write(value a_, value buf_, value ofs_, value len_)
+{
+	CAMLparam4(a_, buf_, ofs_, len_);
+	CAMLreturn(async_submit_io(ASYNC_WRITE, a_, buf_, ofs_, len_));
+}
+
+CAMLprim value ocaml_gnomevfs_async_close(value a_)
+{
+	CAMLparam1(a_);
+	CAMLreturn(async_submit_io(ASYNC_CLOSE, a_, Val_unit, Val_unit, Val_unit));
+}
+
+static value value_of_completion(completion_t *c)
+{
+	CAMLparam0();
+	CAMLlocal2(ans, ev);
+
+	if (c->constant >= 0)
+		ev = Val_int(c->constant);
+	else {
+		ev = caml_alloc(1, c->tag);
+		switch (c->tag) {
+		case EVENT_READ:
+		case EVENT_WRITTEN:
+			Store_field(ev, 0, Val_long(c->bytes));
+			break;
+		case EVENT_ENTRIES:
+			Store_field(ev, 0, caml_copy_string_array((const char **)c->names));
+			break;
+		case EVENT_ERROR:
+			Store_field(ev, 0, Val_int(c->result-1));
+			break;
+		}
+	}
+	ans = caml_alloc_tuple(2);
+	Store_field(ans, 0, Val_long(c->job));
+	Store_field(ans, 1, ev);
+	CAMLreturn(ans);
+}
+
+static void completion_free(completion_t *c)
+{
+	gchar **n;
+
+	if (c->names) {
+		for (n = c->names; *n; n++)
+			g_free(*n);
+		free(c->names);
+	}
+	free(c);
+}
+
+CAMLprim value ocaml_gnomevfs_async_poll(value timeout_)
+{
+	CAMLparam1(timeout_);
+	CAMLlocal3(ans, cell, ev);
+	double timeout = Double_val(timeout_);
+	completion_t *c, *next;
+	struct pollfd pfd;
+	char buf[64];
+	async_start();
+
+	if (!completions && timeout != 0.) {
+		pfd.fd = wakeup[0];
+		pfd.events = POLLIN;
+		caml_enter_blocking_section();
+		poll(&pfd, 1, timeout < 0. ? -1 : (int)(timeout * 1000.));
+		caml_leave_blocking_section();
+	}
+
+	/* Drain the pipe before grabbing the stack: a completion pushed in
+	 * between will write a new byte. */
+	while (read(wakeup[0], buf, sizeof(buf)) > 0);
+	c = __sync_lock_test_and_set(&completions, NULL);
+
+	/* The stack has the most recent completion first, consing them gives
+	 * the list in the order of completion. */
+	ans = Val_emptylist;
+	while (c) {
+		next = c->next;
+		ev = value_of_completion(c);
+		cell = caml_alloc_tuple(2);
+		Store_field(cell, 0, ev);
+		Store_field(cell, 1, ans);
+		ans = cell;
+		completion_free(c);
+		c = next;
+	}
+	CAMLreturn(ans);
+}
@@ -5,13 +5,16 @@
 #include <caml/memory.h>
 #include <caml/mlvalues.h>
 #include <caml/signals.h>
+#include <caml/bigarray.h>
 
 #include <musicbrainz/mb_c.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
-/* Maximum length of retreived data */
+/* Initial length of retreived data */
 #define DATA_LEN 1024
 
 static void cerr(int r)
@@ -164,14 +167,123 @@ CAMLprim value ocaml_musicbrainz_get_result_int(value mb, value result)
   return Val_int(mb_GetResultInt(Mb_val(mb), String_val(result)));
 }
 
+/* Retreive some data in a malloced buffer, or NULL if there is none.
+ * libmusicbrainz silently truncates the data to the size of the buffer,
+ * so it is enlarged until the data fits. Nothing is raised here: NULL is
+ * also returned, with *oom set, when there is no memory left, so that
+ * callers can free their own buffers first. */
+static char *get_result_data(musicbrainz_t mb, char *result, int *ret, int *oom)
+{
+  int len = DATA_LEN;
+  char *data = NULL;
+  char *tmp;
+
+  *oom = 0;
+  while (1)
+  {
+    tmp = realloc(data, len);
+    if (tmp == NULL)
+    {
+      free(data);
+      *oom = 1;
+      return NULL;
+    }
+    data = tmp;
+    data[len - 1] = 0;
+    *ret = mb_GetResultData(mb, result, data, len);
+    if (IsError(*ret))
+    {
+      free(data);
+      return NULL;
+    }
+    data[len - 1] = 0;
+    if (strlen(data) < len - 1)
+      return data;
+    len *= 2;
+  }
+}
+
 CAMLprim value ocaml_musicbrainz_get_result_data(value mb, value result)
 {
-  char data[DATA_LEN];
+  CAMLparam2(mb, result);
+  CAMLlocal1(ans);
+  int ret, oom;
+  char *data = get_result_data(Mb_val(mb), String_val(result), &ret, &oom);
+
+  if (oom)
+    caml_raise_out_of_memory();
+  cerr(ret);
+  if (data == NULL)
+    CAMLreturn(caml_copy_string(""));
+  ans = caml_copy_string(data);
+  free(data);
+
+  CAMLreturn(ans);
+}
+
+/* Missing fields are returned as empty strings. */
+CAMLprim value ocaml_musicbrainz_get_result_fields(value mb, value results)
+{
+  CAMLparam2(mb, results);
+  CAMLlocal2(ans, v);
+  int n = Wosize_val(results);
+  char **data = calloc(n, sizeof(char*));
+  int i, ret, oom = 0;
+
+  if (n > 0 && data == NULL)
+    caml_raise_out_of_memory();
+
+  /* Result names are not moved since no allocation is done here. */
+  for (i = 0; i < n && !oom; i++)
+    data[i] = get_result_data(Mb_val(mb), String_val(Field(results, i)), &ret, &oom);
+  if (oom)
+  {
+    while (i > 0)
+      free(data[--i]);
+    free(data);
+    caml_raise_out_of_memory();
+  }
+
+  ans = caml_alloc_tuple(n);
+  for (i = 0; i < n; i++)
+  {
+    v = caml_copy_string(data[i] ? data[i] : "");
+    Store_field(ans, i, v);
+    free(data[i]);
+  }
+  free(data);
+
+  CAMLreturn(ans);
+}
+
+CAMLprim value ocaml_musicbrainz_get_result_rdf(value mb)
+{
+  CAMLparam1(mb);
+  CAMLlocal1(ans);
+  int len = mb_GetResultRDFLen(Mb_val(mb));
+  char *rdf = malloc(len + 1);
+  int ret;
 
-  cerr(mb_GetResultData(Mb_val(mb), String_val(result), data, DATA_LEN));
+  if (rdf == NULL)
+    caml_raise_out_of_memory();
 
-  /* TODO: is it always NULL-terminated? */
-  return caml_copy_string(data);
+  ret = mb_GetResultRDF(Mb_val(mb), rdf, len + 1);
+  if (!IsError(ret))
+  {
+    rdf[len] = 0;
+    ans = caml_copy_string(rdf);
+  }
+  free(rdf);
+  cerr(ret);
+
+  CAMLreturn(ans);
+}
+
+CAMLprim value ocaml_musicbrainz_set_result_rdf(value mb, value rdf)
+{
+  cerr(mb_SetResultRDF(Mb_val(mb), String_val(rdf)));
+
+  return Val_unit;
 }
 
 CAMLprim value ocaml_musicbrainz_get_id_from_url(value mb, value url)
@@ -183,13 +295,25 @@ CAMLprim value ocaml_musicbrainz_get_id_from_url(value mb, value url)
   return caml_copy_string(id);
 }
 
+/* The file is read without the runtime lock. */
 CAMLprim value ocaml_get_mp3_info(value mb, value fname)
 {
   CAMLparam2(mb, fname);
   CAMLlocal1(ans);
   int duration, bitrate, stereo, samplerate;
+  musicbrainz_t m = Mb_val(mb);
+  char *f = strdup(String_val(fname));
+  int ret;
 
-  cerr(mb_GetMP3Info(Mb_val(mb), String_val(fname), &duration, &bitrate, &stereo, &samplerate));
+  if (f == NULL)
+    caml_raise_out_of_memory();
+
+  caml_enter_blocking_section();
+  ret = mb_GetMP3Info(m, f, &duration, &bitrate, &stereo, &samplerate);
+  caml_leave_blocking_section();
+
+  free(f);
+  cerr(ret);
 
   ans = caml_alloc_tuple(4);
   Store_field(ans, 0, Val_int(duration));
@@ -267,16 +391,33 @@ CAMLprim value ocaml_trm_set_song_length(value trm, value length)
   return Val_unit;
 }
 
+/* Bounds are checked on the OCaml side. */
 CAMLprim value ocaml_trm_generate_signature(value trm, value data, value offs, value len)
 {
   int ret;
-  /* TODO: offs + len < length(data) */
 
   ret = trm_GenerateSignature(Trm_val(trm), String_val(data) + Int_val(offs), Int_val(len));
 
   return Val_bool(ret);
 }
 
+/* Bigarrays do not move, so PCM data is analyzed without the runtime
+ * lock. Bounds are checked on the OCaml side. */
+CAMLprim value ocaml_trm_generate_signature_ba(value _trm, value data, value offs, value len)
+{
+  CAMLparam2(_trm, data);
+  trm_t trm = Trm_val(_trm);
+  char *buf = (char*)Caml_ba_data_val(data) + Int_val(offs);
+  int n = Int_val(len);
+  int ret;
+
+  caml_enter_blocking_section();
+  ret = trm_GenerateSignature(trm, buf, n);
+  caml_leave_blocking_section();
+
+  CAMLreturn(Val_bool(ret));
+}
+
 CAMLprim value ocaml_trm_finalize_signature(value trm, value coll_id)
 {
   /* TODO: coll_id */
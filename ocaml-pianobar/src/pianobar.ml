@@ -22,15 +22,39 @@
 
 (* An interface to libpianobar, which allows access to Pandora radios. *)
 
+(** Statistics about the requests made on a connection. Latencies are
+  * in seconds. *)
+type http_stats =
+  {
+    requests      : int;
+    reconnections : int;
+    last_latency  : float;
+    max_latency   : float;
+    total_latency : float;
+  }
+
+let empty_http_stats =
+  {
+    requests = 0;
+    reconnections = 0;
+    last_latency = 0.;
+    max_latency = 0.;
+    total_latency = 0.;
+  }
+
 (** This is the type of Http request API
   * that the modules require. *)
 module type Http_t =
 sig
   exception Http of string
 
+  type connection
+
   val timeout : float ref
-  val request : ?port:int -> host:string -> url:string -> 
-                request:string -> unit -> string
+  val connection : unit -> connection
+  val stats : connection -> http_stats
+  val request : ?connection:connection -> ?port:int -> host:string ->
+                url:string -> request:string -> unit -> string
 end
 
 module Http_ocamlnet =
@@ -39,14 +63,52 @@ struct
 
   let timeout = ref 5.
 
-  let request ?(port=80) ~host ~url ~request () =
-    let timeout = !timeout in 
-    let call = new Http_client.post_call in
-    let pipeline = new Http_client.pipeline in
+  (* Idle connections are dropped after this time, before the server
+   * closes them. *)
+  let idle_timeout = ref 30.
+
+  let max_connections = ref 2
+
+  type connection =
+    {
+      pipeline          : Http_client.pipeline;
+      mutable last_used : float;
+      mutable stats     : http_stats;
+    }
+
+  let set_options pipeline =
     pipeline#set_options 
       { pipeline#get_options with 
-          Http_client.connection_timeout = timeout 
-      } ;
+          Http_client.connection_timeout = !timeout ;
+          Http_client.number_of_parallel_connections = !max_connections
+      }
+
+  let connection () =
+    let pipeline = new Http_client.pipeline in
+    (* Keep connections open between requests. *)
+    pipeline#set_connection_cache (Http_client.create_aggressive_cache ()) ;
+    { pipeline = pipeline ; last_used = 0. ; stats = empty_http_stats }
+
+  let stats c = c.stats
+
+  let reconnected c =
+    c.stats <- { c.stats with reconnections = c.stats.reconnections + 1 }
+
+  let request ?connection ?(port=80) ~host ~url ~request () =
+    let pipeline =
+      match connection with
+        | Some c ->
+            if c.last_used > 0. && 
+               Unix.gettimeofday () -. c.last_used > !idle_timeout then
+             begin
+              c.pipeline#reset () ;
+              reconnected c
+             end ;
+            c.pipeline
+        | None -> new Http_client.pipeline
+    in
+    set_options pipeline ;
+    let call = new Http_client.post_call in
     let body = call#request_body in
     call#set_request_uri (Printf.sprintf "http://%s:%d%s" host port url) ;
     body#set_value request ; 
@@ -62,13 +124,34 @@ struct
        (Printf.sprintf "ocaml-pianobar/%s" Pianobar_constants.version) ; 
     call#set_request_header http_headers ;
     pipeline#add call ;
+    let start = Unix.gettimeofday () in
     try
       pipeline#run () ;
-      call#response_body#value
+      let ret = call#response_body#value in
+      begin
+       match connection with
+         | Some c ->
+             let t = Unix.gettimeofday () in
+             let latency = t -. start in
+             c.last_used <- t ;
+             c.stats <-
+               { c.stats with
+                   requests = c.stats.requests + 1 ;
+                   last_latency = latency ;
+                   max_latency = max latency c.stats.max_latency ;
+                   total_latency = c.stats.total_latency +. latency }
+         | None -> ()
+      end ;
+      ret
     with
       | Http_client.Http_protocol e 
       | e -> 
          pipeline#reset() ; 
+         begin
+          match connection with
+            | Some c -> reconnected c
+            | None -> ()
+         end ;
          raise (Http  (Printexc.to_string e))
 end
 
@@ -140,6 +223,24 @@ sig
       feedback_rating         :  rating option;
     }
 
+  (** Audio of a prefetched song. *)
+  type audio =
+    | Audio_data of string
+    | Audio_file of string
+
+  (** Where to store the audio of prefetched songs. *)
+  type audio_cache =
+    | Memory
+    | Directory of string
+
+  type prefetched =
+    {
+      prefetched_song  : song;
+      prefetched_audio : audio option;
+    }
+
+  type prefetcher
+
   type error = 
           Error                      |
           Xml_invalid                |
@@ -164,16 +265,44 @@ sig
 
   val string_of_error : error -> string
 
+  val http_stats : t -> http_stats
+
   val login : user:string -> password:string -> t -> unit
 
   val get_stations : t -> station list
 
   val get_playlist : format:audio_format -> station:station -> t -> song list
+
+  val prefetch : ?ahead:int -> ?threshold:int -> ?retry_delay:float ->
+                 ?cache:(audio_cache * (string -> (string -> int -> int -> unit) -> unit)) ->
+                 format:audio_format -> station:station -> t -> prefetcher
+
+  val next_song : prefetcher -> prefetched
+
+  val stop_prefetch : prefetcher -> unit
 end
 
 module Piano_generic(Http : Http_t) = 
 struct
-  type t
+  type handle
+
+  (* Each handle keeps its own HTTP connection. Requests are serialized
+   * since libpiano handles are not thread-safe. *)
+  type t =
+    {
+      handle     : handle;
+      connection : Http.connection;
+      lock       : Mutex.t;
+    }
+
+  let with_lock t f x =
+    Mutex.lock t.lock ;
+    try
+      let ret = f x in
+      Mutex.unlock t.lock ;
+      ret
+    with
+      | e -> Mutex.unlock t.lock ; raise e
 
   external get_host  : unit -> string = "caml_pianobar_host"
   external get_port  : unit -> string = "caml_pianobar_port"
@@ -181,7 +310,19 @@ struct
   let pianobar_host = get_host ()
   let pianobar_port = int_of_string (get_port ())
 
-  external int_of_define : string -> int = "caml_pianobar_int_of_define"
+  external defines : unit -> (string * int) array = "caml_pianobar_defines"
+
+  (* libpiano constants, fetched once. *)
+  let defines =
+    let h = Hashtbl.create 64 in
+    Array.iter (fun (name, v) -> Hashtbl.replace h name v) (defines ()) ;
+    h
+
+  let int_of_define d =
+    try
+      Hashtbl.find defines d
+    with
+      | Not_found -> failwith "unknown value"
 
   type station = 
     { 
@@ -221,43 +362,43 @@ struct
  
   type rating = Love | Ban
 
+  let rate_none = int_of_define "PIANO_RATE_NONE"
+  let rate_love = int_of_define "PIANO_RATE_LOVE"
+  let rate_ban = int_of_define "PIANO_RATE_BAN"
+
   let int_of_rating x =
     match x with
-      | None -> int_of_define "PIANO_RATE_NONE"
-      | Some Love -> int_of_define "PIANO_RATE_LOVE"
-      | Some Ban -> int_of_define "PIANO_RATE_BAN"
+      | None -> rate_none
+      | Some Love -> rate_love
+      | Some Ban -> rate_ban
 
   let rating_of_int x = 
     match x with
-      | x when x = int_of_define "PIANO_RATE_NONE" 
-           -> None
-      | x when x = int_of_define "PIANO_RATE_LOVE"
-           -> Some Love
-      | x when x = int_of_define "PIANO_RATE_BAN"
-           -> Some Ban
+      | x when x = rate_none -> None
+      | x when x = rate_love -> Some Love
+      | x when x = rate_ban -> Some Ban
       | _ -> raise Not_found
 
   type audio_format = Aac_plus | Mp3 | Mp3_high
 
+  let af_unknown = int_of_define "PIANO_AF_UNKNOWN"
+  let af_aacplus = int_of_define "PIANO_AF_AACPLUS"
+  let af_mp3 = int_of_define "PIANO_AF_MP3"
+  let af_mp3_hi = int_of_define "PIANO_AF_MP3_HI"
+
   let int_of_audio_format x =
-    let f = int_of_define in
     match x with
-      | None -> f "PIANO_AF_UNKNOWN"
-      | Some Aac_plus -> f "PIANO_AF_AACPLUS"
-      | Some Mp3 -> f "PIANO_AF_MP3"
-      | Some Mp3_high -> f "PIANO_AF_MP3_HI"
+      | None -> af_unknown
+      | Some Aac_plus -> af_aacplus
+      | Some Mp3 -> af_mp3
+      | Some Mp3_high -> af_mp3_hi
 
   let audio_format_of_int x = 
-    let f = int_of_define in
     match x with
-      | x when x = f "PIANO_AF_UNKNOWN"
-           -> None
-      | x when x = f "PIANO_AF_AACPLUS"
-           -> Some Aac_plus
-      | x when x = f "PIANO_AF_MP3"
-           -> Some Mp3
-      | x when x = f "PIANO_AF_MP3_HI"
-           -> Some Mp3_high
+      | x when x = af_unknown -> None
+      | x when x = af_aacplus -> Some Aac_plus
+      | x when x = af_mp3 -> Some Mp3
+      | x when x = af_mp3_hi -> Some Mp3_high
       | _ -> raise Not_found
 
   type artist =
@@ -431,45 +572,34 @@ struct
           Quickmix_not_playable      |
           Http of string
 
+  (* Errors and their libpiano value. *)
+  let errors =
+    List.map (fun (d, e) -> int_of_define d, e)
+      [
+        "PIANO_RET_ERR", Error;
+        "PIANO_RET_XML_INVALID", Xml_invalid;
+        "PIANO_RET_AUTH_TOKEN_INVALID", Auth_token_invalid;
+        "PIANO_RET_AUTH_USER_PASSWORD_INVALID", Auth_user_password_invalid;
+        "PIANO_RET_CONTINUE_REQUEST", Continue_request;
+        "PIANO_RET_NOT_AUTHORIZED", Not_authorized;
+        "PIANO_RET_PROTOCOL_INCOMPATIBLE", Incompatible_protocol;
+        "PIANO_RET_READONLY_MODE", Readonly_mode;
+        "PIANO_RET_STATION_CODE_INVALID", Station_code_invalid;
+        "PIANO_RET_IP_REJECTED", Ip_rejected;
+        "PIANO_RET_STATION_NONEXISTENT", Station_nonexistent;
+        "PIANO_RET_OUT_OF_MEMORY", Out_of_memory;
+        "PIANO_RET_OUT_OF_SYNC", Out_of_sync;
+        "PIANO_RET_PLAYLIST_END", Playlist_end;
+        "PIANO_RET_QUICKMIX_NOT_PLAYABLE", Quickmix_not_playable;
+      ]
+
   let error_of_int x = 
-    let f = int_of_define in
-    match x with
-      | x when x = f "PIANO_RET_ERR" -> Error
-      | x when x = f "PIANO_RET_XML_INVALID" -> Xml_invalid 
-      | x when x = f "PIANO_RET_AUTH_TOKEN_INVALID" -> Auth_token_invalid 
-      | x when x = f "PIANO_RET_AUTH_USER_PASSWORD_INVALID" -> Auth_user_password_invalid 
-      | x when x = f "PIANO_RET_CONTINUE_REQUEST" -> Continue_request 
-      | x when x = f "PIANO_RET_NOT_AUTHORIZED" -> Not_authorized 
-      | x when x = f "PIANO_RET_PROTOCOL_INCOMPATIBLE" -> Incompatible_protocol
-      | x when x = f "PIANO_RET_READONLY_MODE" -> Readonly_mode 
-      | x when x = f "PIANO_RET_STATION_CODE_INVALID" -> Station_code_invalid 
-      | x when x = f "PIANO_RET_IP_REJECTED" -> Ip_rejected 
-      | x when x = f "PIANO_RET_STATION_NONEXISTENT" -> Station_nonexistent 
-      | x when x = f "PIANO_RET_OUT_OF_MEMORY" -> Out_of_memory 
-      | x when x = f "PIANO_RET_OUT_OF_SYNC" -> Out_of_sync 
-      | x when x = f "PIANO_RET_PLAYLIST_END" -> Playlist_end 
-      | x when x = f "PIANO_RET_QUICKMIX_NOT_PLAYABLE" -> Quickmix_not_playable
-      | _ -> raise Not_found
+    List.assoc x errors
 
   let int_of_error x = 
-    let f = int_of_define in
     match x with
       | Http _ -> raise Not_found
-      | Error -> f "PIANO_RET_ERR"
-      | Xml_invalid -> f "PIANO_RET_XML_INVALID"
-      | Auth_token_invalid -> f "PIANO_RET_AUTH_TOKEN_INVALID"
-      | Auth_user_password_invalid -> f "PIANO_RET_AUTH_USER_PASSWORD_INVALID"
-      | Continue_request -> f "PIANO_RET_CONTINUE_REQUEST"
-      | Not_authorized -> f "PIANO_RET_NOT_AUTHORIZED"
-      | Incompatible_protocol -> f "PIANO_RET_PROTOCOL_INCOMPATIBLE"
-      | Readonly_mode -> f "PIANO_RET_READONLY_MODE"
-      | Station_code_invalid -> f "PIANO_RET_STATION_CODE_INVALID"
-      | Ip_rejected -> f "PIANO_RET_IP_REJECTED"
-      | Station_nonexistent -> f "PIANO_RET_STATION_NONEXISTENT"
-      | Out_of_memory -> f "PIANO_RET_OUT_OF_MEMORY"
-      | Out_of_sync -> f "PIANO_RET_OUT_OF_SYNC"
-      | Playlist_end -> f "PIANO_RET_PLAYLIST_END"
-      | Quickmix_not_playable -> f "PIANO_RET_QUICKMIX_NOT_PLAYABLE"
+      | x -> fst (List.find (fun (_, e) -> e = x) errors)
 
   exception Error of error
 
@@ -479,15 +609,22 @@ struct
   let () = 
     Callback.register "caml_pianobar_raise" raise_error
 
-  (* We wrap Http.request to raise an internal exception. *)
-  let http_request ~url ~request () =
+  (* We wrap Http.request to raise an internal exception. 
+   * This is called by the C stubs for each request. *)
+  let http_request t url request =
     try
-      Http.request ~port:pianobar_port ~host:pianobar_host 
+      Http.request ~connection:t.connection 
+                   ~port:pianobar_port ~host:pianobar_host 
                    ~url ~request ()
     with
       | Http.Http s -> raise (Error (Http s))
   
-  external init : unit -> t = "caml_pianobar_init"
+  external init : unit -> handle = "caml_pianobar_init"
+
+  let init () =
+    { handle = init () ; connection = Http.connection () ; lock = Mutex.create () }
+
+  let http_stats t = Http.stats t.connection
 
   external string_of_error :  int -> string = "caml_pianobar_string_or_error"
 
@@ -496,31 +633,204 @@ struct
       | Http s -> Printf.sprintf "Http error: %s" s
       | x -> string_of_error (int_of_error x)
 
-  let process_req url request =
-    http_request ~url ~request ()
-
-  let () =
-    Callback.register "caml_pianobar_process_req" process_req
-
-  external login : t -> string -> string -> unit = "caml_pianobar_login_req"
-
-  let login ~user ~password t = login t user password
+  external login : handle -> (string -> string -> string) -> string -> string -> unit = "caml_pianobar_login_req"
 
-  let add_elem x l = x::l
+  let login ~user ~password t = 
+    with_lock t (login t.handle (http_request t) user) password
 
-  let () =
-    Callback.register "caml_pianobar_add_elem" add_elem
-
-  external get_stations : t -> station_priv list -> station_priv list = "caml_pianobar_get_stations"
+  external get_stations : handle -> (string -> string -> string) -> station_priv array = "caml_pianobar_get_stations"
 
   let get_stations t = 
-    List.map station_of_station_priv (List.rev (get_stations t []))
+    let ret = with_lock t (get_stations t.handle) (http_request t) in
+    Array.to_list (Array.map station_of_station_priv ret)
 
-  external get_playlist : t -> int -> station_priv -> song_priv list -> song_priv list = "caml_pianobar_get_playlist"
+  external get_playlist : handle -> (string -> string -> string) -> int -> station_priv -> song_priv array = "caml_pianobar_get_playlist"
 
   let get_playlist ~format ~station t = 
-    let ret = get_playlist t (int_of_audio_format (Some format)) (station_priv_of_station station) [] in
-    List.map song_of_song_priv (List.rev ret)
+    let ret = 
+      with_lock t 
+        (get_playlist t.handle (http_request t) (int_of_audio_format (Some format))) 
+        (station_priv_of_station station) 
+    in
+    Array.to_list (Array.map song_of_song_priv ret)
+
+  type audio =
+    | Audio_data of string
+    | Audio_file of string
+
+  type audio_cache =
+    | Memory
+    | Directory of string
+
+  type prefetched =
+    {
+      prefetched_song  : song;
+      prefetched_audio : audio option;
+    }
+
+  type prefetcher =
+    {
+      p_handle      : t;
+      p_format      : audio_format;
+      p_station     : station;
+      p_ahead       : int;
+      p_threshold   : int;
+      p_retry_delay : float;
+      p_cache       : (audio_cache * (string -> (string -> int -> int -> unit) -> unit)) option;
+      p_queue       : prefetched Queue.t;
+      p_mutex       : Mutex.t;
+      p_cond        : Condition.t;
+      mutable p_error   : exn option;
+      mutable p_stopped : bool;
+    }
+
+  let prefetch_audio p song =
+    match p.p_cache with
+      | None -> None
+      | Some (Memory, download) -> 
+          let buf = Buffer.create (1024*1024) in
+          download song.audio_url (Buffer.add_substring buf) ;
+          Some (Audio_data (Buffer.contents buf))
+      | Some (Directory dir, download) ->
+          let ext = 
+            match song.audio_format with
+              | Some Aac_plus -> "mp4"
+              | _ -> "mp3"
+          in
+          let file = 
+            Filename.concat dir (Printf.sprintf "%s.%s" song.music_id ext)
+          in
+          (* Data is written as it comes, files are not held in memory. *)
+          let oc = open_out_bin file in
+          begin
+           try
+            download song.audio_url (output oc) ;
+            close_out oc
+           with
+             | e -> 
+                close_out_noerr oc ; 
+                (try Sys.remove file with _ -> ()) ;
+                raise e
+          end ;
+          Some (Audio_file file)
+
+  (* A failed download should not lose the song, nor the rest of the
+   * playlist: the song is then returned without its audio. *)
+  let prefetch_audio p song =
+    try
+      prefetch_audio p song
+    with
+      | _ -> None
+
+  let prefetch_thread p =
+    let rec wait () =
+      if not p.p_stopped && Queue.length p.p_queue >= p.p_threshold then
+       begin
+        Condition.wait p.p_cond p.p_mutex ;
+        wait ()
+       end
+    in
+    let push x =
+      Mutex.lock p.p_mutex ;
+      Queue.push x p.p_queue ;
+      p.p_error <- None ;
+      Condition.broadcast p.p_cond ;
+      Mutex.unlock p.p_mutex
+    in
+    let rec fill () =
+      Mutex.lock p.p_mutex ;
+      let continue = not p.p_stopped && Queue.length p.p_queue < p.p_ahead in
+      Mutex.unlock p.p_mutex ;
+      if continue then
+       begin
+        match get_playlist ~format:p.p_format ~station:p.p_station p.p_handle with
+          | [] ->
+             (* Asking again at once would loop as fast as the server
+              * answers: wait like after a failure. *)
+             Thread.delay p.p_retry_delay
+          | songs ->
+             List.iter 
+               (fun song -> 
+                  push { prefetched_song = song ; 
+                         prefetched_audio = prefetch_audio p song })
+               songs ;
+             fill ()
+       end
+    in
+    let rec loop () =
+      Mutex.lock p.p_mutex ;
+      wait () ;
+      let stopped = p.p_stopped in
+      Mutex.unlock p.p_mutex ;
+      if not stopped then
+       begin
+        begin
+         try
+          fill ()
+         with
+           | e ->
+              Mutex.lock p.p_mutex ;
+              p.p_error <- Some e ;
+              Condition.broadcast p.p_cond ;
+              Mutex.unlock p.p_mutex ;
+              Thread.delay p.p_retry_delay
+        end ;
+        loop ()
+       end
+    in
+    loop ()
+
+  let prefetch ?(ahead=8) ?(threshold=4) ?(retry_delay=5.) ?cache ~format ~station t =
+    let p = 
+      {
+        p_handle = t;
+        p_format = format;
+        p_station = station;
+        p_ahead = ahead;
+        p_threshold = min threshold ahead;
+        p_retry_delay = retry_delay;
+        p_cache = cache;
+        p_queue = Queue.create ();
+        p_mutex = Mutex.create ();
+        p_cond = Condition.create ();
+        p_error = None;
+        p_stopped = false;
+      }
+    in
+    ignore (Thread.create prefetch_thread p) ;
+    p
+
+  let next_song p =
+    Mutex.lock p.p_mutex ;
+    let rec wait () =
+      if Queue.is_empty p.p_queue && p.p_error = None && not p.p_stopped then
+       begin
+        Condition.wait p.p_cond p.p_mutex ;
+        wait ()
+       end
+    in
+    wait () ;
+    if Queue.is_empty p.p_queue then
+     begin
+      let e = 
+        match p.p_error with
+          | Some e -> e
+          | None -> Not_found
+      in
+      p.p_error <- None ;
+      Mutex.unlock p.p_mutex ;
+      raise e
+     end ;
+    let ret = Queue.pop p.p_queue in
+    Condition.broadcast p.p_cond ;
+    Mutex.unlock p.p_mutex ;
+    ret
+
+  let stop_prefetch p =
+    Mutex.lock p.p_mutex ;
+    p.p_stopped <- true ;
+    Condition.broadcast p.p_cond ;
+    Mutex.unlock p.p_mutex
 
 end
 
@@ -22,18 +22,47 @@
 
 (* An interface to libpianobar, which allows access to Pandora radios. *)
 
+(** Statistics about the requests made on a connection. Latencies are
+  * in seconds. *)
+type http_stats =
+  {
+    requests      : int;
+    reconnections : int;
+    last_latency  : float;
+    max_latency   : float;
+    total_latency : float;
+  }
+
 (** This is the type of Http request API
-  * that the modules require. *)
+  * that the modules require. 
+  * Requests made with the same [connection]
+  * should reuse the same (keep-alive) connections
+  * to the server. *)
 module type Http_t =
 sig
   exception Http of string
 
+  type connection
+
   val timeout : float ref
-  val request : ?port:int -> host:string -> url:string -> 
-                request:string -> unit -> string
+  val connection : unit -> connection
+  val stats : connection -> http_stats
+  val request : ?connection:connection -> ?port:int -> host:string ->
+                url:string -> request:string -> unit -> string
 end
 
-module Http_ocamlnet : Http_t
+(** Ocamlnet implementation. Connections are kept 
+  * open between requests, up to [max_connections]
+  * (default: 2) for each connection value, and are
+  * dropped after [idle_timeout] seconds (default: 30)
+  * without requests. *)
+module Http_ocamlnet :
+sig
+  include Http_t
+
+  val idle_timeout : float ref
+  val max_connections : int ref
+end
 
 module type Piano_t = 
 sig
@@ -103,6 +132,24 @@ sig
       feedback_rating         :  rating option;
     }
 
+  (** Audio of a prefetched song. *)
+  type audio =
+    | Audio_data of string
+    | Audio_file of string
+
+  (** Where to store the audio of prefetched songs. *)
+  type audio_cache =
+    | Memory
+    | Directory of string
+
+  type prefetched =
+    {
+      prefetched_song  : song;
+      prefetched_audio : audio option;
+    }
+
+  type prefetcher
+
   type error = 
           Error                      |
           Xml_invalid                |
@@ -127,11 +174,41 @@ sig
 
   val string_of_error : error -> string
 
+  (** Statistics about the HTTP requests made by the handle. *)
+  val http_stats : t -> http_stats
+
   val login : user:string -> password:string -> t -> unit
 
   val get_stations : t -> station list
 
   val get_playlist : format:audio_format -> station:station -> t -> song list
+
+  (** [prefetch ~format ~station t] starts a thread which keeps
+    * at least [ahead] songs (default: 8) of the playlist of [station]
+    * ready, fetching new ones as soon as fewer than [threshold]
+    * (default: 4) are left. Failed requests, and requests returning
+    * an empty playlist, are retried after [retry_delay] seconds
+    * (default: 5.).
+    * If [cache] is [(c, download)], the audio of each song is also
+    * fetched in advance by calling [download url write] on its
+    * [audio_url], which should call [write buf ofs len] on each
+    * block of data received. The audio is kept in memory or
+    * written in the given directory as it is received. Files
+    * are not removed afterwards. Songs whose download failed
+    * are returned with no audio. 
+    * The handle can still be used meanwhile, requests are serialized. *)
+  val prefetch : ?ahead:int -> ?threshold:int -> ?retry_delay:float ->
+                 ?cache:(audio_cache * (string -> (string -> int -> int -> unit) -> unit)) ->
+                 format:audio_format -> station:station -> t -> prefetcher
+
+  (** Next song of a prefetcher, waiting for it if needed. The last
+    * error of the prefetching thread is raised if no song could be 
+    * fetched. Raises [Not_found] once the prefetcher is stopped and
+    * all the prefetched songs were returned. *)
+  val next_song : prefetcher -> prefetched
+
+  (** Stop the prefetching thread. *)
+  val stop_prefetch : prefetcher -> unit
 end
 
 module Piano_generic (Http : Http_t) : Piano_t
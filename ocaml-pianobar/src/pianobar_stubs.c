@@ -23,9 +23,11 @@
 #include <caml/fail.h>
 #include <caml/custom.h>
 #include <caml/callback.h>
+#include <caml/signals.h>
 
 #include <pianobar/piano.h>
 
+#include <stdlib.h>
 #include <string.h>
 
 CAMLprim value caml_pianobar_host(value unit) 
@@ -40,97 +42,84 @@ CAMLprim value caml_pianobar_port(value unit)
   CAMLreturn(caml_copy_string(PIANO_RPC_PORT));
 }
 
-CAMLprim value caml_pianobar_int_of_define(value d)
+/* libpiano constants, exported once to OCaml as an array of (name, value).
+ * New constants only need to be added to this table. */
+#define DEFINE(x) { #x, x }
+
+static const struct {
+  const char *name;
+  int value;
+} pianobar_defines[] = {
+  DEFINE(PIANO_RATE_NONE),
+  DEFINE(PIANO_RATE_LOVE),
+  DEFINE(PIANO_RATE_BAN),
+  DEFINE(PIANO_AF_UNKNOWN),
+  DEFINE(PIANO_AF_AACPLUS),
+  DEFINE(PIANO_AF_MP3),
+  DEFINE(PIANO_AF_MP3_HI),
+  DEFINE(PIANO_REQUEST_LOGIN),
+  DEFINE(PIANO_REQUEST_GET_STATIONS),
+  DEFINE(PIANO_REQUEST_GET_PLAYLIST),
+  DEFINE(PIANO_REQUEST_RATE_SONG),
+  DEFINE(PIANO_REQUEST_ADD_FEEDBACK),
+  DEFINE(PIANO_REQUEST_MOVE_SONG),
+  DEFINE(PIANO_REQUEST_RENAME_STATION),
+  DEFINE(PIANO_REQUEST_DELETE_STATION),
+  DEFINE(PIANO_REQUEST_SEARCH),
+  DEFINE(PIANO_REQUEST_CREATE_STATION),
+  DEFINE(PIANO_REQUEST_ADD_SEED),
+  DEFINE(PIANO_REQUEST_ADD_TIRED_SONG),
+  DEFINE(PIANO_REQUEST_SET_QUICKMIX),
+  DEFINE(PIANO_REQUEST_GET_GENRE_STATIONS),
+  DEFINE(PIANO_REQUEST_TRANSFORM_STATION),
+  DEFINE(PIANO_REQUEST_EXPLAIN),
+  DEFINE(PIANO_REQUEST_GET_SEED_SUGGESTIONS),
+  DEFINE(PIANO_REQUEST_BOOKMARK_SONG),
+  DEFINE(PIANO_REQUEST_BOOKMARK_ARTIST),
+  DEFINE(PIANO_RET_ERR),
+  DEFINE(PIANO_RET_OK),
+  DEFINE(PIANO_RET_XML_INVALID),
+  DEFINE(PIANO_RET_AUTH_TOKEN_INVALID),
+  DEFINE(PIANO_RET_AUTH_USER_PASSWORD_INVALID),
+  DEFINE(PIANO_RET_CONTINUE_REQUEST),
+  DEFINE(PIANO_RET_NOT_AUTHORIZED),
+  DEFINE(PIANO_RET_PROTOCOL_INCOMPATIBLE),
+  DEFINE(PIANO_RET_READONLY_MODE),
+  DEFINE(PIANO_RET_STATION_CODE_INVALID),
+  DEFINE(PIANO_RET_IP_REJECTED),
+  DEFINE(PIANO_RET_STATION_NONEXISTENT),
+  DEFINE(PIANO_RET_OUT_OF_MEMORY),
+  DEFINE(PIANO_RET_OUT_OF_SYNC),
+  DEFINE(PIANO_RET_PLAYLIST_END),
+  DEFINE(PIANO_RET_QUICKMIX_NOT_PLAYABLE),
+};
+
+CAMLprim value caml_pianobar_defines(value unit)
 {
-  CAMLparam1(d);
-  char *s = String_val(d);
-
-  if (!strcmp(s,"PIANO_RATE_NONE"))
-    CAMLreturn(Val_int(PIANO_RATE_NONE));
-  if (!strcmp(s,"PIANO_RATE_LOVE"))
-    CAMLreturn(Val_int(PIANO_RATE_LOVE));
-  if (!strcmp(s,"PIANO_RATE_BAN"))
-    CAMLreturn(Val_int(PIANO_RATE_BAN));
-  if (!strcmp(s,"PIANO_AF_UNKNOWN"))
-    CAMLreturn(Val_int(PIANO_AF_UNKNOWN));
-  if (!strcmp(s,"PIANO_AF_AACPLUS"))
-    CAMLreturn(Val_int(PIANO_AF_AACPLUS));
-  if (!strcmp(s,"PIANO_AF_MP3"))
-    CAMLreturn(Val_int(PIANO_AF_MP3));
-  if (!strcmp(s,"PIANO_AF_MP3_HI"))
-    CAMLreturn(Val_int(PIANO_AF_MP3_HI));
-  if (!strcmp(s,"PIANO_REQUEST_LOGIN"))
-    CAMLreturn(Val_int(PIANO_REQUEST_LOGIN));
-  if (!strcmp(s,"PIANO_REQUEST_GET_STATIONS"))
-    CAMLreturn(Val_int(PIANO_REQUEST_GET_STATIONS));
-  if (!strcmp(s,"PIANO_REQUEST_GET_PLAYLIST"))
-    CAMLreturn(Val_int(PIANO_REQUEST_GET_PLAYLIST));
-  if (!strcmp(s,"PIANO_REQUEST_RATE_SONG"))
-    CAMLreturn(Val_int(PIANO_REQUEST_RATE_SONG));
-  if (!strcmp(s,"PIANO_REQUEST_ADD_FEEDBACK"))
-    CAMLreturn(Val_int(PIANO_REQUEST_ADD_FEEDBACK));
-  if (!strcmp(s,"PIANO_REQUEST_MOVE_SONG"))
-    CAMLreturn(Val_int(PIANO_REQUEST_MOVE_SONG));
-  if (!strcmp(s,"PIANO_REQUEST_RENAME_STATION"))
-    CAMLreturn(Val_int(PIANO_REQUEST_RENAME_STATION));
-  if (!strcmp(s,"PIANO_REQUEST_DELETE_STATION"))
-    CAMLreturn(Val_int(PIANO_REQUEST_DELETE_STATION));
-  if (!strcmp(s,"PIANO_REQUEST_SEARCH"))
-    CAMLreturn(Val_int(PIANO_REQUEST_SEARCH));
-  if (!strcmp(s,"PIANO_REQUEST_CREATE_STATION"))
-    CAMLreturn(Val_int(PIANO_REQUEST_CREATE_STATION));
-  if (!strcmp(s,"PIANO_REQUEST_ADD_SEED"))
-    CAMLreturn(Val_int(PIANO_REQUEST_ADD_SEED));
-  if (!strcmp(s,"PIANO_REQUEST_ADD_TIRED_SONG"))
-    CAMLreturn(Val_int(PIANO_REQUEST_ADD_TIRED_SONG));
-  if (!strcmp(s,"PIANO_REQUEST_SET_QUICKMIX"))
-    CAMLreturn(Val_int(PIANO_REQUEST_SET_QUICKMIX));
-  if (!strcmp(s,"PIANO_REQUEST_GET_GENRE_STATIONS"))
-    CAMLreturn(Val_int(PIANO_REQUEST_GET_GENRE_STATIONS));
-  if (!strcmp(s,"PIANO_REQUEST_TRANSFORM_STATION"))
-    CAMLreturn(Val_int(PIANO_REQUEST_TRANSFORM_STATION));
-  if (!strcmp(s,"PIANO_REQUEST_EXPLAIN"))
-    CAMLreturn(Val_int(PIANO_REQUEST_EXPLAIN));
-  if (!strcmp(s,"PIANO_REQUEST_GET_SEED_SUGGESTIONS"))
-    CAMLreturn(Val_int(PIANO_REQUEST_GET_SEED_SUGGESTIONS));
-  if (!strcmp(s,"PIANO_REQUEST_BOOKMARK_SONG"))
-    CAMLreturn(Val_int(PIANO_REQUEST_BOOKMARK_SONG));
-  if (!strcmp(s,"PIANO_REQUEST_BOOKMARK_ARTIST"))
-    CAMLreturn(Val_int(PIANO_REQUEST_BOOKMARK_ARTIST));
-  if (!strcmp(s,"PIANO_RET_ERR"))
-    CAMLreturn(Val_int(PIANO_RET_ERR));
-  if (!strcmp(s,"PIANO_RET_OK"))
-    CAMLreturn(Val_int(PIANO_RET_OK));
-  if (!strcmp(s,"PIANO_RET_XML_INVALID"))
-    CAMLreturn(Val_int(PIANO_RET_XML_INVALID));
-  if (!strcmp(s,"PIANO_RET_AUTH_TOKEN_INVALID"))
-    CAMLreturn(Val_int(PIANO_RET_AUTH_TOKEN_INVALID));
-  if (!strcmp(s,"PIANO_RET_AUTH_USER_PASSWORD_INVALID"))
-    CAMLreturn(Val_int(PIANO_RET_AUTH_USER_PASSWORD_INVALID));
-  if (!strcmp(s,"PIANO_RET_CONTINUE_REQUEST"))
-    CAMLreturn(Val_int(PIANO_RET_CONTINUE_REQUEST));
-  if (!strcmp(s,"PIANO_RET_NOT_AUTHORIZED"))
-    CAMLreturn(Val_int(PIANO_RET_NOT_AUTHORIZED));
-  if (!strcmp(s,"PIANO_RET_PROTOCOL_INCOMPATIBLE"))
-    CAMLreturn(Val_int(PIANO_RET_PROTOCOL_INCOMPATIBLE));
-  if (!strcmp(s,"PIANO_RET_READONLY_MODE"))
-    CAMLreturn(Val_int(PIANO_RET_READONLY_MODE));
-  if (!strcmp(s,"PIANO_RET_STATION_CODE_INVALID"))
-    CAMLreturn(Val_int(PIANO_RET_STATION_CODE_INVALID));
-  if (!strcmp(s,"PIANO_RET_IP_REJECTED"))
-    CAMLreturn(Val_int(PIANO_RET_IP_REJECTED));
-  if (!strcmp(s,"PIANO_RET_STATION_NONEXISTENT"))
-    CAMLreturn(Val_int(PIANO_RET_STATION_NONEXISTENT));
-  if (!strcmp(s,"PIANO_RET_OUT_OF_MEMORY"))
-    CAMLreturn(Val_int(PIANO_RET_OUT_OF_MEMORY));
-  if (!strcmp(s,"PIANO_RET_OUT_OF_SYNC"))
-    CAMLreturn(Val_int(PIANO_RET_OUT_OF_SYNC));
-  if (!strcmp(s,"PIANO_RET_PLAYLIST_END"))
-    CAMLreturn(Val_int(PIANO_RET_PLAYLIST_END));
-  if (!strcmp(s,"PIANO_RET_QUICKMIX_NOT_PLAYABLE"))
-    CAMLreturn(Val_int(PIANO_RET_QUICKMIX_NOT_PLAYABLE));
-  
-  caml_failwith("unknown value");
+  CAMLparam0();
+  CAMLlocal2(ret,d);
+  int i;
+  int n = sizeof(pianobar_defines) / sizeof(pianobar_defines[0]);
+
+  ret = caml_alloc_tuple(n);
+  for (i = 0; i < n; i++) {
+    d = caml_alloc_tuple(2);
+    Store_field(d,0,caml_copy_string(pianobar_defines[i].name));
+    Store_field(d,1,Val_int(pianobar_defines[i].value));
+    Store_field(ret,i,d);
+  }
+
+  CAMLreturn(ret);
+}
+
+/* Callback registered by the OCaml side, looked up once in
+ * caml_pianobar_init. Registering it again (e.g. when applying
+ * Piano_generic twice) keeps the same pointer. */
+static value *pianobar_raise = NULL;
+
+static void raise_error(int err)
+{
+  caml_callback(*pianobar_raise,Val_int(err));
 }
 
 static value val_of_station(PianoStation_t *s) 
@@ -148,19 +137,33 @@ static value val_of_station(PianoStation_t *s)
   CAMLreturn(ret);
 }
 
+/* Strings are copied since libpiano uses them outside of the OCaml
+ * runtime lock. Use free_station to release them. */
 static PianoStation_t *station_of_val(PianoStation_t *s, value v)
 {
   int i = 0;
   s->isCreator = Int_val(Field(v, i++));
   s->isQuickMix = Int_val(Field(v, i++));
   s->useQuickMix = Int_val(Field(v, i++));
-  s->name = String_val(Field(v, i++));
-  s->id = String_val(Field(v, i++));
+  s->name = strdup(String_val(Field(v, i++)));
+  s->id = strdup(String_val(Field(v, i++)));
   s->next = NULL;
 
+  if (s->name == NULL || s->id == NULL) {
+    free(s->name);
+    free(s->id);
+    caml_raise_out_of_memory();
+  }
+
   return s;
 }
 
+static void free_station(PianoStation_t *s)
+{
+  free(s->name);
+  free(s->id);
+}
+
 static value val_of_song(PianoSong_t *s)
 {
   CAMLparam0();
@@ -209,7 +212,12 @@ CAMLprim value caml_pianobar_init(value unit)
   CAMLparam0();
   CAMLlocal1(ans);
 
-  PianoHandle_t *handle = malloc(sizeof(PianoHandle_t));
+  PianoHandle_t *handle;
+
+  if (pianobar_raise == NULL)
+    pianobar_raise = caml_named_value("caml_pianobar_raise");
+
+  handle = malloc(sizeof(PianoHandle_t));
   if (handle == NULL)
     caml_raise_out_of_memory();
 
@@ -227,101 +235,151 @@ CAMLprim value caml_pianobar_string_or_error(value er)
   CAMLreturn(caml_copy_string(PianoErrorToStr(Int_val(er))));
 }
 
-static int process_req(PianoHandle_t *h, void *reqData, PianoRequestType_t x)
+/* Run a request, using the OCaml function http to send each HTTP request
+ * to the server. Building requests and parsing responses is done without
+ * the OCaml runtime lock, so reqData and the handle must not point into
+ * the OCaml heap. This function does not raise, so that callers can free
+ * their data: an exception raised by http is returned in *exn, which must
+ * be a registered root. */
+static int process_req(PianoHandle_t *h, value http, void *reqData, PianoRequestType_t x, value *exn)
 {
-  CAMLparam0();
+  CAMLparam1(http);
   CAMLlocal3(url,data,ret);
   int err = PIANO_RET_CONTINUE_REQUEST;
   PianoRequest_t req;
+  memset(&req,0,sizeof(req));
   req.data = reqData;
   req.type = x;
 
   do {
+    caml_enter_blocking_section();
     err = PianoRequest(h,&req,x);
+    caml_leave_blocking_section();
     if (err != PIANO_RET_OK) {
       PianoDestroyRequest(&req); 
-      caml_callback(*caml_named_value("caml_pianobar_raise"),Val_int(err));
+      break;
     }
 
     url = caml_copy_string(req.urlPath);
     data = caml_copy_string(req.postData);
-    ret = caml_callback2_exn(*caml_named_value("caml_pianobar_process_req"),url,data);
+    ret = caml_callback2_exn(http,url,data);
     if (Is_exception_result(ret))
     {
       PianoDestroyRequest(&req);
-      caml_raise(Extract_exception(ret));
+      *exn = Extract_exception(ret);
+      err = PIANO_RET_ERR;
+      break;
+    }
+
+    /* The response is parsed in place. */
+    req.responseData = strdup(String_val(ret));
+    if (req.responseData == NULL) {
+      PianoDestroyRequest(&req);
+      err = PIANO_RET_OUT_OF_MEMORY;
+      break;
     }
-    req.responseData = String_val(ret);
+
+    caml_enter_blocking_section();
     err = PianoResponse(h,&req);
+    caml_leave_blocking_section();
+    free(req.responseData);
     PianoDestroyRequest (&req);
   } while (err == PIANO_RET_CONTINUE_REQUEST);
 
   CAMLreturn(err);
 }
 
-CAMLprim value caml_pianobar_login_req(value _h, value user, value password)
+static void check_req(int err, value exn)
 {
-  CAMLparam3(_h,user,password);
-  CAMLlocal1(ret);
+  if (exn != Val_unit)
+    caml_raise(exn);
+  if (err != PIANO_RET_OK)
+    raise_error(err);
+}
+
+CAMLprim value caml_pianobar_login_req(value _h, value http, value user, value password)
+{
+  CAMLparam4(_h,http,user,password);
+  CAMLlocal1(exn);
   int err;
   PianoRequestDataLogin_t reqData;
   PianoHandle_t *h = Handle_val(_h);  
 
-  reqData.user = String_val(user);
-  reqData.password = String_val(password);
+  reqData.user = strdup(String_val(user));
+  reqData.password = strdup(String_val(password));
+  if (reqData.user == NULL || reqData.password == NULL) {
+    free(reqData.user);
+    free(reqData.password);
+    caml_raise_out_of_memory();
+  }
+
+  exn = Val_unit;
+  err = process_req(h,http,(void *) &reqData,PIANO_REQUEST_LOGIN,&exn);
+  free(reqData.user);
+  free(reqData.password);
+  check_req(err,exn);
 
-  err = process_req(h,(void *) &reqData,PIANO_REQUEST_LOGIN);
-  if (err != PIANO_RET_OK) 
-    caml_callback(*caml_named_value("caml_pianobar_raise"),Val_int(err));
   CAMLreturn(Val_unit);
 }
 
-CAMLprim value caml_pianobar_get_stations(value _h, value ret)
+CAMLprim value caml_pianobar_get_stations(value _h, value http)
 {
-  CAMLparam2(_h,ret);
+  CAMLparam2(_h,http);
+  CAMLlocal3(ret,v,exn);
   PianoHandle_t *h = Handle_val(_h);
   PianoStation_t *s;
   int err;
+  int i = 0;
  
   if (h->stations == NULL) {
-    err = process_req(h,NULL,PIANO_REQUEST_GET_STATIONS);
-    if (err != PIANO_RET_OK)
-      caml_callback(*caml_named_value("caml_pianobar_raise"),Val_int(err));
+    exn = Val_unit;
+    err = process_req(h,http,NULL,PIANO_REQUEST_GET_STATIONS,&exn);
+    check_req(err,exn);
   }
 
-  s = h->stations;
-  while (s != NULL) {
-    ret = caml_callback2(*caml_named_value("caml_pianobar_add_elem"),val_of_station(s),ret);
-    s = s->next;  
+  for (s = h->stations; s != NULL; s = s->next)
+    i++;
+  ret = caml_alloc_tuple(i);
+
+  for (s = h->stations, i = 0; s != NULL; s = s->next, i++) {
+    v = val_of_station(s);
+    Store_field(ret,i,v);
   }
 
   CAMLreturn(ret);
 }
 
-CAMLprim value caml_pianobar_get_playlist(value _h, value _format, value _station, value ret)
+CAMLprim value caml_pianobar_get_playlist(value _h, value http, value _format, value _station)
 {
-  CAMLparam3(_h,ret,_station);
+  CAMLparam4(_h,http,_format,_station);
+  CAMLlocal3(ret,v,exn);
   PianoHandle_t *h = Handle_val(_h);
   PianoRequestDataGetPlaylist_t reqData;
   PianoStation_t s;
   PianoSong_t *song;
   int err;
+  int i = 0;
  
   station_of_val(&s,_station);
   reqData.station = &s;
   reqData.format = Int_val(_format);
   reqData.retPlaylist = NULL;
 
-  err = process_req(h,(void *)&reqData,PIANO_REQUEST_GET_PLAYLIST);
+  exn = Val_unit;
+  err = process_req(h,http,(void *)&reqData,PIANO_REQUEST_GET_PLAYLIST,&exn);
+  free_station(&s);
   if (err != PIANO_RET_OK) {
     PianoDestroyPlaylist(reqData.retPlaylist);
-    caml_callback(*caml_named_value("caml_pianobar_raise"),Val_int(err));
+    check_req(err,exn);
   }
 
-  song = reqData.retPlaylist;
-  while (song != NULL) {
-    ret = caml_callback2(*caml_named_value("caml_pianobar_add_elem"),val_of_song(song),ret);
-    song = song->next;
+  for (song = reqData.retPlaylist; song != NULL; song = song->next)
+    i++;
+  ret = caml_alloc_tuple(i);
+
+  for (song = reqData.retPlaylist, i = 0; song != NULL; song = song->next, i++) {
+    v = val_of_song(song);
+    Store_field(ret,i,v);
   }
 
   PianoDestroyPlaylist(reqData.retPlaylist);
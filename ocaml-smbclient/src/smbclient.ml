@@ -27,7 +27,8 @@ type auth_function = string -> string -> string -> string -> (string * string *
 
 type file_descr = int
 
-type dir_handle = int
+(* The url is kept for stat'ing the entries in readdir_all. *)
+type dir_handle = { dh : int ; durl : string ; }
 
 type open_flag =
   | O_RDONLY
@@ -53,6 +54,12 @@ type file_kind =
 
 type dirent = { kind : file_kind ; comment : string ; name : string ; }
 
+type data = (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+type entry = { dirent : dirent ; size : int ; mtime : float ; }
+
+type readahead_stats = { hits : int ; misses : int ; stalled : float ; }
+
 type seek_command = (* do not change the order *)
   | SEEK_SET
   | SEEK_CUR
@@ -91,19 +98,43 @@ external openfile : string -> open_flag list -> file_perm -> file_descr  = "ocam
 
 external c_samba_read : file_descr -> string -> int -> int -> int  = "ocaml_samba_read"
 
+external c_samba_read_bigarray : file_descr -> data -> int -> int -> int = "ocaml_samba_read_ba"
+
+external c_samba_pread : file_descr -> int64 -> data -> int -> int -> int = "ocaml_samba_pread_ba"
+
+external c_samba_write : file_descr -> string -> int -> int -> int = "ocaml_samba_write"
+
+external c_samba_write_bigarray : file_descr -> data -> int -> int -> int = "ocaml_samba_write_ba"
+
+external ftruncate : file_descr -> int -> unit = "ocaml_samba_ftruncate"
+
+external unlink : string -> unit = "ocaml_samba_unlink"
+
 external close : file_descr -> unit = "ocaml_samba_close"
 
-external opendir : string -> dir_handle = "ocaml_samba_opendir"
+external readahead : file_descr -> int -> unit = "ocaml_samba_readahead"
+
+external readahead_stats : file_descr -> readahead_stats = "ocaml_samba_readahead_stats"
 
-external closedir: dir_handle -> unit = "ocaml_samba_closedir"
+external c_opendir : string -> int = "ocaml_samba_opendir"
 
-external readdir: dir_handle -> dirent = "ocaml_samba_readdir"
+external c_closedir: int -> unit = "ocaml_samba_closedir"
+
+external c_readdir: int -> dirent = "ocaml_samba_readdir"
+
+external c_readdir_all: int -> string -> entry array = "ocaml_samba_readdir_all"
 
 external lseek: file_descr -> int -> seek_command -> int = "ocaml_samba_lseek"
 
 external lseek64: file_descr -> int64 -> seek_command -> int64 = "ocaml_samba_lseek64"
 
-external isavail: string -> bool = "ocaml_samba_isavail"
+external is_avail: string -> bool = "ocaml_samba_isavail"
+
+external c_set_stat_cache : float -> float -> int -> unit = "ocaml_samba_stat_cache_set"
+
+external invalidate_stat_cache : string option -> unit = "ocaml_samba_stat_cache_invalidate"
+
+external stat_cache_stats : unit -> int * int = "ocaml_samba_stat_cache_stats"
 
 external error_message: error -> string = "samba_error_message"
 
@@ -116,5 +147,110 @@ let read fd buf ofs len =
   then invalid_arg "Unix.read"
   else c_samba_read fd buf ofs len
 
+let set_stat_cache ?(negative_ttl=0.) ?(max_entries=65536) ttl =
+  c_set_stat_cache ttl negative_ttl max_entries
+
+let invalidate_stat_cache ?url () = invalidate_stat_cache url
+
+let read_bigarray fd buf ofs len =
+  if ofs < 0 || len < 0 || ofs > Bigarray.Array1.dim buf - len
+  then invalid_arg "Smbclient.read_bigarray"
+  else c_samba_read_bigarray fd buf ofs len
+
+let pread fd pos buf ofs len =
+  if ofs < 0 || len < 0 || ofs > Bigarray.Array1.dim buf - len
+  then invalid_arg "Smbclient.pread"
+  else c_samba_pread fd pos buf ofs len
+
+let write fd buf ofs len =
+  if ofs < 0 || len < 0 || ofs > String.length buf - len
+  then invalid_arg "Smbclient.write"
+  else c_samba_write fd buf ofs len
+
+let write_bigarray fd buf ofs len =
+  if ofs < 0 || len < 0 || ofs > Bigarray.Array1.dim buf - len
+  then invalid_arg "Smbclient.write_bigarray"
+  else c_samba_write_bigarray fd buf ofs len
+
+let read_all fd =
+  let cur = lseek64 fd 0L SEEK_CUR in
+  let len = Int64.to_int (Int64.sub (lseek64 fd 0L SEEK_END) cur) in
+  let buf = Bigarray.Array1.create Bigarray.char Bigarray.c_layout len in
+  let n = c_samba_pread fd cur buf 0 len in
+    if n = len then buf else Bigarray.Array1.sub buf 0 n
+
+let opendir durl = { dh = c_opendir durl ; durl = durl }
+
+let closedir d = c_closedir d.dh
+
+let readdir d = c_readdir d.dh
+
+let readdir_all d = c_readdir_all d.dh d.durl
+
 (* TODO: config file *)
 let default_init () = init ~debug:0 (fun _ _ wg un -> wg, un, "")
+
+module Context =
+struct
+  type t
+
+  type file_descr
+
+  type dir_handle
+
+  external create : auth_function -> int -> t = "ocaml_samba_ctx_create"
+
+  let create ?(debug=0) fn = create fn debug
+
+  external is_avail : t -> string -> bool = "ocaml_samba_ctx_isavail"
+
+  external openfile : t -> string -> open_flag list -> file_perm -> file_descr = "ocaml_samba_ctx_open"
+
+  external c_read : file_descr -> string -> int -> int -> int = "ocaml_samba_ctx_read"
+
+  external c_read_bigarray : file_descr -> data -> int -> int -> int = "ocaml_samba_ctx_read_ba"
+
+  external lseek : file_descr -> int -> seek_command -> int = "ocaml_samba_ctx_lseek"
+
+  external close : file_descr -> unit = "ocaml_samba_ctx_close"
+
+  external opendir : t -> string -> dir_handle = "ocaml_samba_ctx_opendir"
+
+  external closedir : dir_handle -> unit = "ocaml_samba_ctx_closedir"
+
+  external readdir : dir_handle -> dirent = "ocaml_samba_ctx_readdir"
+
+  let read fd buf ofs len =
+    if ofs < 0 || len < 0 || ofs > String.length buf - len
+    then invalid_arg "Smbclient.Context.read"
+    else c_read fd buf ofs len
+
+  let read_bigarray fd buf ofs len =
+    if ofs < 0 || len < 0 || ofs > Bigarray.Array1.dim buf - len
+    then invalid_arg "Smbclient.Context.read_bigarray"
+    else c_read_bigarray fd buf ofs len
+end
+
+module Crawler =
+struct
+  type t
+
+  external create : int -> int -> int -> string * string * string -> string -> t = "ocaml_samba_crawl_create"
+
+  let create ?(workers=4) ?(batch=256) ?(queue=16) ~workgroup ~user ~password url =
+    create workers batch queue (workgroup, user, password) url
+
+  external next : t -> (string * int * float) array = "ocaml_samba_crawl_next"
+
+  external errors : t -> int = "ocaml_samba_crawl_errors"
+
+  external stop : t -> unit = "ocaml_samba_crawl_stop"
+
+  let iter f c =
+    try
+      while true do
+        Array.iter f (next c)
+      done
+    with
+      | End_of_file -> ()
+end
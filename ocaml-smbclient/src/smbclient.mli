@@ -63,6 +63,19 @@ type file_kind =
 (** A filename and its kind. *)
 type dirent = { kind : file_kind ; comment : string ; name : string ; }
 
+(** Buffers for reading large blocks without copying. *)
+type data = (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+(** A directory entry together with its size (in bytes) and its last
+  modification time (as returned by [Unix.time]). The size is [-1] and the
+  time [0.] when they are not known, e.g. for servers or shares. *)
+type entry = { dirent : dirent ; size : int ; mtime : float ; }
+
+(** Statistics about the readahead of a file: number of reads served
+  directly from the readahead buffer, number of reads which had to wait for
+  data, and total time spent waiting (in seconds). *)
+type readahead_stats = { hits : int ; misses : int ; stalled : float ; }
+
 (** Way seek commands should be interpreted. *)
 type seek_command =
   | SEEK_SET
@@ -104,8 +117,27 @@ val init : ?debug:int -> auth_function -> unit
 (** Same as above with reasonable default parameters *)
 val default_init : unit -> unit
 
-(* (** Is a file available ? *)
-val is_avail : string -> bool *)
+(** Is a file available? The answer is taken from the cache when it is
+  enabled, see [set_stat_cache]. *)
+val is_avail : string -> bool
+
+(** [set_stat_cache ttl] enables caching the answers of [is_avail] for [ttl]
+  seconds ([0.] disables the cache, which is the default). The cache is
+  emptied.
+  @param negative_ttl time during which a file is known to be unavailable
+  ([0.], the default, disables negative caching)
+  @param max_entries maximal number of files in the cache, which is emptied
+  when it is reached (defaults to 65536)
+*)
+val set_stat_cache : ?negative_ttl:float -> ?max_entries:int -> float -> unit
+
+(** Drop a file, or all the files if none is given, from the cache. Files
+  created or removed through this module are dropped automatically, and
+  files found by [readdir_all] are added. *)
+val invalidate_stat_cache : ?url:string -> unit -> unit
+
+(** Number of hits and misses of the cache. *)
+val stat_cache_stats : unit -> int * int
 (* val get_type : string -> file_kind *)
 
 (** [openfile filename flags mode] opens the file [filename]. [filename] should be of the form "smb://TOTO/path/tatu.mp3".
@@ -115,9 +147,52 @@ val openfile : string -> open_flag list -> file_perm -> file_descr
 (** [read fd buf ofs len] reads [len] bytes in the file [fd] storing them in [buf], starting at position [ofs]. *)
 val read : file_descr -> string -> int -> int -> int
 
+(** [read_bigarray fd buf ofs len] reads [len] bytes in the file [fd] storing
+  them in [buf], starting at position [ofs]. Contrarily to [read], the data is
+  read directly into [buf], without any limit on [len]: fewer than [len] bytes
+  are read only when the end of the file is reached. Other threads can run
+  during the read. *)
+val read_bigarray : file_descr -> data -> int -> int -> int
+
+(** [pread fd pos buf ofs len] is the same as [read_bigarray fd buf ofs len]
+  but reads from the position [pos] in the file. The position of [fd] is left
+  after the read data. *)
+val pread : file_descr -> int64 -> data -> int -> int -> int
+
+(** Read the file from the current position until its end. *)
+val read_all : file_descr -> data
+
+(** [write fd buf ofs len] writes [len] bytes to the file [fd], taking them
+  from [buf], starting at position [ofs]. Returns the number of bytes
+  actually written, which is always [len]. *)
+val write : file_descr -> string -> int -> int -> int
+
+(** Same as [write] but takes the data from a bigarray, without any copy.
+  Large blocks should be preferred: the whole block is written in one call,
+  using as few network requests as possible. *)
+val write_bigarray : file_descr -> data -> int -> int -> int
+
+(** Truncate a file to the given size. *)
+val ftruncate : file_descr -> int -> unit
+
+(** Remove a file. *)
+val unlink : string -> unit
+
 (** Seel in a file. *)
 val lseek : file_descr -> int -> seek_command -> int
 
+(** [readahead fd size] starts reading ahead the file [fd] in a background
+  thread, keeping up to [size] bytes following the current position in a
+  buffer from which [read], [read_bigarray] and [pread] are then served.
+  Seeking forward inside the buffered data is free, other seeks drop it.
+  Readahead is stopped when [size] is [0] or when the file is closed. It is
+  intended for sequential reads: a typical [size] is a few megabytes. *)
+val readahead : file_descr -> int -> unit
+
+(** Statistics about the readahead of a file, which should have been
+  started with [readahead]. *)
+val readahead_stats : file_descr -> readahead_stats
+
 (** Close a previously opened file. *)
 val close : file_descr -> unit
 
@@ -129,3 +204,98 @@ val closedir : dir_handle -> unit
 
 (** Get the next entry in the directory or [End_of_file] if none is left. *)
 val readdir : dir_handle -> dirent
+
+(** Get all the remaining entries in the directory, along with the size and
+  modification time of files and directories, in one call. The entries
+  ["."] and [".."] are left out. When libsmbclient provides
+  [smbc_readdirplus], entries of shares are read along with their
+  attributes and have an empty comment; [smbc_readdirplus] has its own
+  position in the directory, so entries already returned by [readdir] on
+  the same handle are returned again. *)
+val readdir_all : dir_handle -> entry array
+
+(** Contexts are independent instances of the samba library, each one with
+  its own connections and authentication function. Contrarily to the global
+  instance used by the functions above, which serializes all the calls,
+  operations in different contexts can run concurrently: typically, each
+  thread or each connection pool should use its own context. Operations in a
+  given context are still serialized. *)
+module Context :
+sig
+  (** A context. It is freed, along with its connections, by a background
+    thread when it is garbage-collected. *)
+  type t
+
+  (** Files opened in a context. *)
+  type file_descr
+
+  (** Directories opened in a context. *)
+  type dir_handle
+
+  (** Create a new context.
+    @param debug print debug message (0 to 5)
+    @param auth_function the function used for obtain share rigth
+  *)
+  val create : ?debug:int -> auth_function -> t
+
+  (** Is a file available? *)
+  val is_avail : t -> string -> bool
+
+  (** Same as [Smbclient.openfile] in a context. *)
+  val openfile : t -> string -> open_flag list -> file_perm -> file_descr
+
+  (** Same as [Smbclient.read]. *)
+  val read : file_descr -> string -> int -> int -> int
+
+  (** Same as [Smbclient.read_bigarray]. *)
+  val read_bigarray : file_descr -> data -> int -> int -> int
+
+  (** Same as [Smbclient.lseek]. *)
+  val lseek : file_descr -> int -> seek_command -> int
+
+  (** Close a previously opened file. *)
+  val close : file_descr -> unit
+
+  (** Open a directory in a context. *)
+  val opendir : t -> string -> dir_handle
+
+  (** Close a previously opened directory. *)
+  val closedir : dir_handle -> unit
+
+  (** Get the next entry in the directory or [End_of_file] if none is left. *)
+  val readdir : dir_handle -> dirent
+end
+
+(** Parallel recursive listing of directories, e.g. for indexing large
+  shares. Directories are crawled by several threads, each one with its own
+  context, and the files found are handed in batches. *)
+module Crawler :
+sig
+  (** A crawler. It is stopped when it is garbage-collected. *)
+  type t
+
+  (** [create ~workgroup ~user ~password url] starts crawling [url]
+    recursively. Since crawling threads cannot call OCaml functions, the
+    credentials are given directly instead of an authentication function.
+    @param workers number of crawling threads, i.e. of concurrent requests
+    (defaults to 4)
+    @param batch maximum number of files in a batch (defaults to 256)
+    @param queue maximum number of batches waiting to be handled before the
+    crawling threads are paused (defaults to 16)
+  *)
+  val create : ?workers:int -> ?batch:int -> ?queue:int -> workgroup:string -> user:string -> password:string -> string -> t
+
+  (** Get the next batch of files found, as triples (url, size, modification
+    time), waiting for one if needed. Raises [End_of_file] when the crawling
+    is over. *)
+  val next : t -> (string * int * float) array
+
+  (** Iterate over all the files found until the end of the crawling. *)
+  val iter : (string * int * float -> unit) -> t -> unit
+
+  (** Number of directories and files which could not be read. *)
+  val errors : t -> int
+
+  (** Stop crawling. *)
+  val stop : t -> unit
+end
@@ -49,11 +49,16 @@
 #include <caml/callback.h>  /* callback        */
 #include <caml/alloc.h>     /* copy_*          */
 #include <caml/misc.h>      /* CAMLprim        */
+#include <caml/bigarray.h>  /* Caml_ba_*       */
+#include <caml/custom.h>    /* custom blocks   */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include <errno.h>
+#include <pthread.h>
 
 #include <libsmbclient.h>
 
@@ -61,6 +66,13 @@
 
 #define UNIX_BUFFER_SIZE 16384
 
+/* The global context of libsmbclient is not thread-safe: every call to it is
+ * protected by this lock, so that OCaml threads and readahead threads can
+ * share it. Contexts created with smbc_new_context have their own lock. */
+static pthread_mutex_t samba_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define Lock_samba() pthread_mutex_lock(&samba_mutex)
+#define Unlock_samba() pthread_mutex_unlock(&samba_mutex)
+
 /* TODO: not portable */
 #define Val_file_offset(fofs) caml_copy_int64(fofs)
 #define File_offset_val(v) ((off_t) Int64_val(v))
@@ -133,21 +145,50 @@ CAMLprim value samba_error_message(value err)
 /** The authentication fonction in Caml language */
 static value auth_fn_caml ;
 
-/** The authentication function in C language */
-static void auth_fn(const char *srv,
-		    const char *shr,
-		    char *wg, int wglen,
-		    char *un, int unlen,
-		    char *pw, int pwlen)
+/** Set in threads which are not known to the OCaml runtime. */
+static pthread_key_t foreign_thread_key;
+static pthread_once_t foreign_thread_once = PTHREAD_ONCE_INIT;
+
+static void foreign_thread_key_init(void)
 {
+  pthread_key_create(&foreign_thread_key, NULL);
+}
+
+/* Apply the Caml authentication function fn and copy the credentials it
+ * returns. Should be called with the runtime lock held.
+ *
+ * The caller holds samba_mutex (or the lock of a context), so nothing may be
+ * raised from here: if the function raises an exception or returns
+ * credentials which are too long, empty credentials are returned and the
+ * authentication fails. Calling back into OCaml with those locks held is
+ * safe because they are never taken while holding the runtime lock. */
+static void samba_auth_caml(value *fn,
+                            const char *srv,
+                            const char *shr,
+                            char *wg, int wglen,
+                            char *un, int unlen,
+                            char *pw, int pwlen)
+{
+  CAMLparam0();
   CAMLlocal1(res);
-  value args[] = { copy_string(srv), copy_string(shr), copy_string(wg), copy_string(un) };
+  CAMLlocalN(args, 4);
 
-  /* re-acquire the master lock before the callback */
-  leave_blocking_section();
+  args[0] = copy_string(srv);
+  args[1] = copy_string(shr);
+  args[2] = copy_string(wg);
+  args[3] = copy_string(un);
   /* apply the Caml function to find the needed arguments */
-  res = callbackN(auth_fn_caml, 4, args);
-  enter_blocking_section();
+  res = caml_callbackN_exn(*fn, 4, args);
+
+  if (Is_exception_result(res) ||
+      string_length (Field(res,0)) >= wglen ||
+      string_length (Field(res,1)) >= unlen ||
+      string_length (Field(res,2)) >= pwlen) {
+    if (wglen > 0) wg[0] = 0;
+    if (unlen > 0) un[0] = 0;
+    if (pwlen > 0) pw[0] = 0;
+    CAMLreturn0;
+  }
 
 #ifdef DEBUG
   printf("smbclient - workgroup: %s\n", String_val(Field(res,0)));
@@ -155,15 +196,42 @@ static void auth_fn(const char *srv,
   printf("smbclient - password: %s\n", String_val(Field(res,2)));
 #endif
 
-  if (string_length (Field(res,0)) >= wglen ||
-      string_length (Field(res,1)) >= unlen ||
-      string_length (Field(res,2)) >= pwlen)
-    // TODO: find a better way to report the error ?
-    caml_raise_out_of_memory();
-
   strcpy(wg, String_val(Field(res, 0))) ;
   strcpy(un, String_val(Field(res, 1))) ;
   strcpy(pw, String_val(Field(res, 2))) ;
+  CAMLreturn0;
+}
+
+/* Apply the Caml authentication function fn. Should be called inside a
+ * blocking section. */
+static void samba_auth(value *fn,
+                       const char *srv,
+                       const char *shr,
+                       char *wg, int wglen,
+                       char *un, int unlen,
+                       char *pw, int pwlen)
+{
+  /* re-acquire the master lock before the callback */
+  leave_blocking_section();
+  samba_auth_caml(fn, srv, shr, wg, wglen, un, unlen, pw, pwlen);
+  enter_blocking_section();
+}
+
+/** The authentication function in C language */
+static void auth_fn(const char *srv,
+		    const char *shr,
+		    char *wg, int wglen,
+		    char *un, int unlen,
+		    char *pw, int pwlen)
+{
+  /* The OCaml function cannot be called from a readahead thread, the hints
+   * are left as is: the connection should have been authenticated when the
+   * file was opened anyway. */
+  pthread_once(&foreign_thread_once, foreign_thread_key_init);
+  if (pthread_getspecific(foreign_thread_key))
+    return;
+
+  samba_auth(&auth_fn_caml, srv, shr, wg, wglen, un, unlen, pw, pwlen);
 }
 
 /** Initialisation of samba */
@@ -175,13 +243,193 @@ CAMLprim value ocaml_samba_init (value fn, value debug)
 
   auth_fn_caml = fn;
   enter_blocking_section();
+  Lock_samba();
   ret = smbc_init (auth_fn, Int_val(debug));
+  Unlock_samba();
   leave_blocking_section();
   if (ret) serror("smbc_init", Nothing);
 
   CAMLreturn (Val_unit);
 }
 
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/*
+ *  Cache of the availability of files
+ */
+
+#define STAT_CACHE_BUCKETS 4096
+
+typedef struct stat_entry
+{
+  char *url;
+  int avail;
+  double expires;
+  struct stat_entry *next;
+} stat_entry_t;
+
+static stat_entry_t *stat_cache[STAT_CACHE_BUCKETS];
+static long stat_cache_entries = 0;
+static long stat_cache_max = 65536;
+/* The cache is disabled when ttl is 0. */
+static double stat_cache_ttl = 0;
+static double stat_cache_negative_ttl = 0;
+static long stat_cache_hits = 0;
+static long stat_cache_misses = 0;
+static pthread_mutex_t stat_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int stat_cache_hash(const char *url)
+{
+  unsigned int h = 5381;
+
+  while (*url)
+    h = h * 33 + (unsigned char)*url++;
+
+  return h % STAT_CACHE_BUCKETS;
+}
+
+/* Should be called with the mutex held. */
+static void stat_cache_clear(void)
+{
+  stat_entry_t *e;
+  int i;
+
+  for (i = 0; i < STAT_CACHE_BUCKETS; i++)
+    while (stat_cache[i]) {
+      e = stat_cache[i];
+      stat_cache[i] = e->next;
+      free(e->url);
+      free(e);
+    }
+  stat_cache_entries = 0;
+}
+
+/* Returns 1 if available, 0 if not and -1 if unknown. */
+static int stat_cache_find(const char *url)
+{
+  stat_entry_t *e;
+  int ans = -1;
+
+  pthread_mutex_lock(&stat_cache_mutex);
+  if (stat_cache_ttl > 0) {
+    for (e = stat_cache[stat_cache_hash(url)]; e; e = e->next)
+      if (!strcmp(e->url, url)) {
+        if (e->expires >= now()) ans = e->avail;
+        break;
+      }
+    if (ans < 0)
+      stat_cache_misses++;
+    else
+      stat_cache_hits++;
+  }
+  pthread_mutex_unlock(&stat_cache_mutex);
+
+  return ans;
+}
+
+static void stat_cache_add(const char *url, int avail)
+{
+  unsigned int h = stat_cache_hash(url);
+  double ttl;
+  stat_entry_t *e;
+
+  pthread_mutex_lock(&stat_cache_mutex);
+  ttl = avail ? stat_cache_ttl : stat_cache_negative_ttl;
+  if (stat_cache_ttl <= 0 || ttl <= 0) {
+    pthread_mutex_unlock(&stat_cache_mutex);
+    return;
+  }
+  for (e = stat_cache[h]; e && strcmp(e->url, url); e = e->next);
+  if (!e) {
+    /* We keep things simple: everything is dropped when the cache is full. */
+    if (stat_cache_entries >= stat_cache_max) stat_cache_clear();
+    e = malloc(sizeof(stat_entry_t));
+    if (e) e->url = strdup(url);
+    if (!e || !e->url) {
+      free(e);
+      pthread_mutex_unlock(&stat_cache_mutex);
+      return;
+    }
+    e->next = stat_cache[h];
+    stat_cache[h] = e;
+    stat_cache_entries++;
+  }
+  e->avail = avail;
+  e->expires = now() + ttl;
+  pthread_mutex_unlock(&stat_cache_mutex);
+}
+
+static void stat_cache_remove(const char *url)
+{
+  stat_entry_t **p, *e;
+
+  pthread_mutex_lock(&stat_cache_mutex);
+  for (p = &stat_cache[stat_cache_hash(url)]; *p && strcmp((*p)->url, url); p = &(*p)->next);
+  e = *p;
+  if (e) {
+    *p = e->next;
+    free(e->url);
+    free(e);
+    stat_cache_entries--;
+  }
+  pthread_mutex_unlock(&stat_cache_mutex);
+}
+
+/** Configure the cache. */
+CAMLprim value ocaml_samba_stat_cache_set(value ttl, value negative_ttl, value max)
+{
+  CAMLparam3(ttl, negative_ttl, max);
+
+  pthread_mutex_lock(&stat_cache_mutex);
+  stat_cache_ttl = Double_val(ttl);
+  stat_cache_negative_ttl = Double_val(negative_ttl);
+  stat_cache_max = Long_val(max);
+  stat_cache_clear();
+  pthread_mutex_unlock(&stat_cache_mutex);
+
+  CAMLreturn(Val_unit);
+}
+
+/** Drop a file (or all files if none is specified) from the cache. */
+CAMLprim value ocaml_samba_stat_cache_invalidate(value furl)
+{
+  CAMLparam1(furl);
+
+  if (Is_block(furl))
+    stat_cache_remove(String_val(Field(furl, 0)));
+  else {
+    pthread_mutex_lock(&stat_cache_mutex);
+    stat_cache_clear();
+    pthread_mutex_unlock(&stat_cache_mutex);
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+/** Hits and misses of the cache. */
+CAMLprim value ocaml_samba_stat_cache_stats(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(ans);
+  long hits, misses;
+
+  pthread_mutex_lock(&stat_cache_mutex);
+  hits = stat_cache_hits;
+  misses = stat_cache_misses;
+  pthread_mutex_unlock(&stat_cache_mutex);
+
+  ans = caml_alloc_tuple(2);
+  Store_field(ans, 0, Val_long(hits));
+  Store_field(ans, 1, Val_long(misses));
+  CAMLreturn(ans);
+}
+
 /** Is the file available? */
 CAMLprim value ocaml_samba_isavail(value furl)
 {
@@ -189,9 +437,17 @@ CAMLprim value ocaml_samba_isavail(value furl)
   char * name = String_val(furl);
   struct stat st;
   int ret;
+
+  ret = stat_cache_find(name);
+  if (ret >= 0)
+    CAMLreturn(Val_bool(ret));
+
   enter_blocking_section();
+  Lock_samba();
   ret = smbc_stat(name, &st);
+  Unlock_samba();
   leave_blocking_section();
+  stat_cache_add(String_val(furl), ret >= 0);
   if (ret < 0)
       CAMLreturn(Val_false);
 
@@ -206,14 +462,19 @@ static int smb_open_flag_table[] = {
 CAMLprim value ocaml_samba_open(value furl, value flags, value mode)
 {
   CAMLparam3(furl, flags, mode);
+  int cflags = convert_flag_list(flags, smb_open_flag_table);
   int ret;
 
   enter_blocking_section();
-  ret = smbc_open(String_val(furl), convert_flag_list(flags, smb_open_flag_table), Int_val(mode));
+  Lock_samba();
+  ret = smbc_open(String_val(furl), cflags, Int_val(mode));
+  Unlock_samba();
   leave_blocking_section();
 
   if (ret < 0)
     serror("smbc_open",furl);
+  if (cflags & O_CREAT)
+    stat_cache_remove(String_val(furl));
 
   CAMLreturn (Val_int(ret));
 }
@@ -222,6 +483,381 @@ static int seek_command_table[] = {
   SEEK_SET, SEEK_CUR, SEEK_END
 };
 
+/*
+ *  Readahead
+ */
+
+/* Maximal size of a single read of a readahead thread. */
+#define READAHEAD_CHUNK (1024 * 1024)
+
+typedef struct readahead
+{
+  int fd;
+  char *buf;      /* ring buffer */
+  size_t size;    /* size of the ring buffer */
+  size_t start;   /* offset of the first available byte in the buffer */
+  size_t len;     /* number of available bytes */
+  off_t pos;      /* position in the file of the first available byte */
+  int gen;        /* incremented each time the buffer is dropped */
+  int eof;
+  int err;
+  int stop;
+  long hits;
+  long misses;
+  double stalled; /* time spent waiting for data, in seconds */
+  int refs;       /* protected by readaheads_mutex */
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct readahead *next;
+} readahead_t;
+
+static readahead_t *readaheads = NULL;
+static pthread_mutex_t readaheads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Find the readahead of a file. The list holds a reference to each
+ * readahead and the caller gets another one, which should be dropped with
+ * readahead_release, so that a concurrent readahead_stop does not free it
+ * while it is used. */
+static readahead_t *readahead_find(int fd)
+{
+  readahead_t *ra;
+
+  pthread_mutex_lock(&readaheads_mutex);
+  for (ra = readaheads; ra && ra->fd != fd; ra = ra->next);
+  if (ra) ra->refs++;
+  pthread_mutex_unlock(&readaheads_mutex);
+
+  return ra;
+}
+
+static void readahead_release(readahead_t *ra)
+{
+  int last;
+
+  pthread_mutex_lock(&readaheads_mutex);
+  last = --ra->refs == 0;
+  pthread_mutex_unlock(&readaheads_mutex);
+  if (!last) return;
+
+  pthread_cond_destroy(&ra->cond);
+  pthread_mutex_destroy(&ra->mutex);
+  free(ra->buf);
+  free(ra);
+}
+
+static void *readahead_thread(void *arg)
+{
+  readahead_t *ra = arg;
+  size_t wofs, n;
+  off_t fpos;
+  ssize_t ret;
+  int gen, err;
+
+  pthread_once(&foreign_thread_once, foreign_thread_key_init);
+  pthread_setspecific(foreign_thread_key, ra);
+
+  pthread_mutex_lock(&ra->mutex);
+  while (1) {
+    while (!ra->stop && (ra->len == ra->size || ra->eof || ra->err))
+      pthread_cond_wait(&ra->cond, &ra->mutex);
+    if (ra->stop) break;
+
+    /* We are the only writer, readers never look past start + len so that
+     * the free part of the buffer can be filled without holding the lock. */
+    wofs = (ra->start + ra->len) % ra->size;
+    n = ra->size - ra->len;
+    if (n > ra->size - wofs) n = ra->size - wofs;
+    if (n > READAHEAD_CHUNK) n = READAHEAD_CHUNK;
+    fpos = ra->pos + ra->len;
+    gen = ra->gen;
+    pthread_mutex_unlock(&ra->mutex);
+
+    Lock_samba();
+    ret = smbc_lseek(ra->fd, fpos, SEEK_SET);
+    if (ret != (off_t)-1)
+      ret = smbc_read(ra->fd, ra->buf + wofs, n);
+    err = errno;
+    Unlock_samba();
+
+    pthread_mutex_lock(&ra->mutex);
+    /* The buffer was dropped in the meantime: the data is not relevant
+     * anymore. */
+    if (gen != ra->gen) continue;
+    if (ret < 0)
+      ra->err = err ? err : EIO;
+    else if (ret == 0)
+      ra->eof = 1;
+    else
+      ra->len += ret;
+    pthread_cond_broadcast(&ra->cond);
+  }
+  pthread_mutex_unlock(&ra->mutex);
+
+  return NULL;
+}
+
+/* Take up to len bytes out of the readahead buffer, waiting for the readahead
+ * thread if none is available. Returns 0 at the end of the file. Should be
+ * called inside a blocking section. */
+static ssize_t readahead_read(readahead_t *ra, char *buf, size_t len)
+{
+  size_t n, done = 0;
+  double t;
+
+  pthread_mutex_lock(&ra->mutex);
+  if (ra->len == 0 && !ra->eof && !ra->err && !ra->stop) {
+    ra->misses++;
+    t = now();
+    while (ra->len == 0 && !ra->eof && !ra->err && !ra->stop)
+      pthread_cond_wait(&ra->cond, &ra->mutex);
+    ra->stalled += now() - t;
+  }
+  else
+    ra->hits++;
+
+  /* The file was closed meanwhile. */
+  if (ra->len == 0 && ra->stop) {
+    pthread_mutex_unlock(&ra->mutex);
+    errno = EBADF;
+    return -1;
+  }
+
+  if (ra->len == 0 && ra->err) {
+    errno = ra->err;
+    ra->err = 0;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+    return -1;
+  }
+
+  while (done < len && ra->len > 0) {
+    n = len - done;
+    if (n > ra->len) n = ra->len;
+    if (n > ra->size - ra->start) n = ra->size - ra->start;
+    memcpy(buf + done, ra->buf + ra->start, n);
+    ra->start = (ra->start + n) % ra->size;
+    ra->len -= n;
+    ra->pos += n;
+    done += n;
+  }
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->mutex);
+
+  return done;
+}
+
+/* Seek in a file with readahead. Seeking forward inside the buffered data
+ * keeps it, otherwise it is dropped. Should be called inside a blocking
+ * section. */
+static off_t readahead_lseek(readahead_t *ra, off_t ofs, int whence)
+{
+  off_t end;
+
+  /* The size is found before taking the lock of the readahead: samba_mutex
+   * should never be waited for while holding it. The readahead thread seeks
+   * before each read, so that moving the position here is harmless. */
+  if (whence == SEEK_END) {
+    Lock_samba();
+    end = smbc_lseek(ra->fd, 0, SEEK_END);
+    Unlock_samba();
+    if (end == (off_t)-1)
+      return -1;
+    ofs += end;
+  }
+
+  pthread_mutex_lock(&ra->mutex);
+  if (whence == SEEK_CUR)
+    ofs += ra->pos;
+  if (ofs < 0) {
+    pthread_mutex_unlock(&ra->mutex);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (ofs >= ra->pos && ofs - ra->pos <= ra->len) {
+    ra->start = (ra->start + (ofs - ra->pos)) % ra->size;
+    ra->len -= ofs - ra->pos;
+  }
+  else {
+    ra->start = 0;
+    ra->len = 0;
+    ra->eof = 0;
+    ra->err = 0;
+    ra->gen++;
+  }
+  ra->pos = ofs;
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->mutex);
+
+  return ofs;
+}
+
+/* Stop the readahead on a file and put back the position of the file where
+ * it is expected to be. Should be called inside a blocking section. */
+static void readahead_stop(int fd)
+{
+  readahead_t **p, *ra;
+
+  pthread_mutex_lock(&readaheads_mutex);
+  for (p = &readaheads; *p && (*p)->fd != fd; p = &(*p)->next);
+  ra = *p;
+  if (ra) *p = ra->next;
+  pthread_mutex_unlock(&readaheads_mutex);
+  if (!ra) return;
+
+  pthread_mutex_lock(&ra->mutex);
+  ra->stop = 1;
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->mutex);
+  pthread_join(ra->thread, NULL);
+
+  Lock_samba();
+  smbc_lseek(fd, ra->pos, SEEK_SET);
+  Unlock_samba();
+
+  /* Drop the reference of the list. */
+  readahead_release(ra);
+}
+
+/* Seek in a file. Should be called inside a blocking section. */
+static off_t samba_lseek(int fd, off_t ofs, int whence)
+{
+  readahead_t *ra = readahead_find(fd);
+  off_t ret;
+
+  if (ra) {
+    ret = readahead_lseek(ra, ofs, whence);
+    readahead_release(ra);
+    return ret;
+  }
+
+  Lock_samba();
+  ret = smbc_lseek(fd, ofs, whence);
+  Unlock_samba();
+
+  return ret;
+}
+
+/* Read at most len bytes in a file. Should be called inside a blocking
+ * section. */
+static ssize_t samba_read(int fd, char *buf, size_t len)
+{
+  readahead_t *ra = readahead_find(fd);
+  ssize_t ret;
+  int err;
+
+  if (ra) {
+    ret = readahead_read(ra, buf, len);
+    err = errno;
+    readahead_release(ra);
+    errno = err;
+    return ret;
+  }
+
+  Lock_samba();
+  ret = smbc_read(fd, buf, len);
+  Unlock_samba();
+
+  return ret;
+}
+
+/** Start (or stop when size is 0) reading ahead a file. */
+CAMLprim value ocaml_samba_readahead(value fd, value size)
+{
+  CAMLparam2(fd, size);
+  readahead_t *ra;
+  off_t pos;
+  int err = 0;
+
+  enter_blocking_section();
+  readahead_stop(Int_val(fd));
+  leave_blocking_section();
+  if (Long_val(size) <= 0) CAMLreturn(Val_unit);
+
+  ra = malloc(sizeof(readahead_t));
+  if (ra) ra->buf = malloc(Long_val(size));
+  if (!ra || !ra->buf) {
+    free(ra);
+    caml_raise_out_of_memory();
+  }
+
+  enter_blocking_section();
+  Lock_samba();
+  pos = smbc_lseek(Int_val(fd), 0, SEEK_CUR);
+  err = errno;
+  Unlock_samba();
+  leave_blocking_section();
+  if (pos == (off_t)-1) {
+    free(ra->buf);
+    free(ra);
+    samba_error(err, "smbc_lseek", Nothing);
+  }
+
+  ra->fd = Int_val(fd);
+  ra->size = Long_val(size);
+  ra->start = 0;
+  ra->len = 0;
+  ra->pos = pos;
+  ra->gen = 0;
+  ra->eof = 0;
+  ra->err = 0;
+  ra->stop = 0;
+  ra->hits = 0;
+  ra->misses = 0;
+  ra->stalled = 0;
+  ra->refs = 1;
+  pthread_mutex_init(&ra->mutex, NULL);
+  pthread_cond_init(&ra->cond, NULL);
+  err = pthread_create(&ra->thread, NULL, readahead_thread, ra);
+  if (err) {
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->mutex);
+    free(ra->buf);
+    free(ra);
+    samba_error(err, "pthread_create", Nothing);
+  }
+
+  pthread_mutex_lock(&readaheads_mutex);
+  ra->next = readaheads;
+  readaheads = ra;
+  pthread_mutex_unlock(&readaheads_mutex);
+
+  CAMLreturn(Val_unit);
+}
+
+/** Statistics about the readahead of a file. */
+CAMLprim value ocaml_samba_readahead_stats(value fd)
+{
+  CAMLparam1(fd);
+  CAMLlocal1(ans);
+  readahead_t *ra;
+  long hits = 0, misses = 0;
+  double stalled = 0;
+
+  /* The lock of the readahead should not be waited for with the runtime
+   * lock held. */
+  enter_blocking_section();
+  ra = readahead_find(Int_val(fd));
+  if (ra) {
+    pthread_mutex_lock(&ra->mutex);
+    hits = ra->hits;
+    misses = ra->misses;
+    stalled = ra->stalled;
+    pthread_mutex_unlock(&ra->mutex);
+    readahead_release(ra);
+  }
+  leave_blocking_section();
+
+  if (!ra) samba_error(EINVAL, "readahead_stats", Nothing);
+
+  ans = caml_alloc_tuple(3);
+  Store_field(ans, 0, Val_long(hits));
+  Store_field(ans, 1, Val_long(misses));
+  Store_field(ans, 2, caml_copy_double(stalled));
+  CAMLreturn(ans);
+}
+
 /** Seek in a file */
 CAMLprim value ocaml_samba_lseek(value fd, value offset, value whence)
 {
@@ -229,8 +865,8 @@ CAMLprim value ocaml_samba_lseek(value fd, value offset, value whence)
   off_t ret;
 
   enter_blocking_section();
-  ret = smbc_lseek(Int_val(fd), Long_val(offset),
-		   seek_command_table[Int_val(whence)]);
+  ret = samba_lseek(Int_val(fd), Long_val(offset),
+                    seek_command_table[Int_val(whence)]);
   leave_blocking_section();
   if (ret == (off_t)-1)
     serror("smbc_lseek", Nothing);
@@ -245,8 +881,8 @@ CAMLprim value ocaml_samba_lseek64(value fd, value ofs, value cmd)
   off_t ret;
 
   enter_blocking_section();
-  ret = smbc_lseek(Int_val(fd), File_offset_val(ofs),
-                       seek_command_table[Int_val(cmd)]);
+  ret = samba_lseek(Int_val(fd), File_offset_val(ofs),
+                    seek_command_table[Int_val(cmd)]);
   leave_blocking_section();
   if (ret == (off_t)-1) serror("smbc_lseek", Nothing);
   CAMLreturn(Val_file_offset(ret));
@@ -263,7 +899,7 @@ CAMLprim value ocaml_samba_read(value fd, value buf, value ofs, value len)
     numbytes = Long_val(len);
     if (numbytes > UNIX_BUFFER_SIZE) numbytes = UNIX_BUFFER_SIZE;
     enter_blocking_section();
-    ret = smbc_read(Int_val(fd), iobuf, (int) numbytes);
+    ret = samba_read(Int_val(fd), iobuf, (int) numbytes);
     leave_blocking_section();
     if (ret < 0) {
       if (!errno) { /* end_of_file */
@@ -278,6 +914,156 @@ CAMLprim value ocaml_samba_read(value fd, value buf, value ofs, value len)
   return Val_int(ret);
 }
 
+/* Read up to len bytes, stopping early only at the end of the file. Should be
+ * called inside a blocking section. */
+static ssize_t samba_read_full(int fd, char *buf, size_t len)
+{
+  size_t done = 0;
+  ssize_t ret;
+
+  while (done < len) {
+    ret = samba_read(fd, buf + done, len - done);
+    if (ret < 0) return -1;
+    if (ret == 0) break;
+    done += ret;
+  }
+
+  return done;
+}
+
+/** Read a file into a bigarray. */
+CAMLprim value ocaml_samba_read_ba(value fd, value ba, value ofs, value len)
+{
+  CAMLparam4(fd, ba, ofs, len);
+  char *buf = (char*)Caml_ba_data_val(ba) + Long_val(ofs);
+  ssize_t ret;
+
+  enter_blocking_section();
+  ret = samba_read_full(Int_val(fd), buf, Long_val(len));
+  leave_blocking_section();
+  if (ret < 0) serror("smbc_read", Nothing);
+
+  CAMLreturn(Val_long(ret));
+}
+
+/** Read a file into a bigarray from a given position. */
+CAMLprim value ocaml_samba_pread_ba(value fd, value fofs, value ba, value ofs, value len)
+{
+  CAMLparam5(fd, fofs, ba, ofs, len);
+  char *buf = (char*)Caml_ba_data_val(ba) + Long_val(ofs);
+  off_t pos;
+  ssize_t ret = -1;
+
+  enter_blocking_section();
+  pos = samba_lseek(Int_val(fd), File_offset_val(fofs), SEEK_SET);
+  if (pos != (off_t)-1)
+    ret = samba_read_full(Int_val(fd), buf, Long_val(len));
+  leave_blocking_section();
+  if (pos == (off_t)-1) serror("smbc_lseek", Nothing);
+  if (ret < 0) serror("smbc_read", Nothing);
+
+  CAMLreturn(Val_long(ret));
+}
+
+/* Write len bytes. Should be called inside a blocking section. */
+static ssize_t samba_write_full(int fd, const char *buf, size_t len)
+{
+  size_t done = 0;
+  ssize_t ret;
+
+  /* Data read ahead would not be up to date anymore. */
+  readahead_stop(fd);
+
+  Lock_samba();
+  while (done < len) {
+    ret = smbc_write(fd, (char*)buf + done, len - done);
+    if (ret <= 0) {
+      /* Nothing written: we would loop forever. */
+      if (ret == 0) errno = EIO;
+      Unlock_samba();
+      return -1;
+    }
+    done += ret;
+  }
+  Unlock_samba();
+
+  return done;
+}
+
+/** Write a file. */
+CAMLprim value ocaml_samba_write(value fd, value buf, value ofs, value len)
+{
+  CAMLparam4(fd, buf, ofs, len);
+  long numbytes = Long_val(len);
+  ssize_t ret;
+  char iobuf[UNIX_BUFFER_SIZE];
+  char *data = iobuf;
+
+  /* The string might be moved during the blocking section, large ones are
+   * copied at once in order to be written in one call. */
+  if (numbytes > UNIX_BUFFER_SIZE) {
+    data = malloc(numbytes);
+    if (!data) caml_raise_out_of_memory();
+  }
+  memmove(data, &Byte(buf, Long_val(ofs)), numbytes);
+  enter_blocking_section();
+  ret = samba_write_full(Int_val(fd), data, numbytes);
+  leave_blocking_section();
+  if (data != iobuf) free(data);
+  if (ret < 0) serror("smbc_write", Nothing);
+
+  CAMLreturn(Val_long(ret));
+}
+
+/** Write a bigarray in a file. */
+CAMLprim value ocaml_samba_write_ba(value fd, value ba, value ofs, value len)
+{
+  CAMLparam4(fd, ba, ofs, len);
+  char *buf = (char*)Caml_ba_data_val(ba) + Long_val(ofs);
+  ssize_t ret;
+
+  enter_blocking_section();
+  ret = samba_write_full(Int_val(fd), buf, Long_val(len));
+  leave_blocking_section();
+  if (ret < 0) serror("smbc_write", Nothing);
+
+  CAMLreturn(Val_long(ret));
+}
+
+/** Truncate a file. */
+CAMLprim value ocaml_samba_ftruncate(value fd, value len)
+{
+  CAMLparam2(fd, len);
+  int ret;
+
+  enter_blocking_section();
+  readahead_stop(Int_val(fd));
+  Lock_samba();
+  ret = smbc_ftruncate(Int_val(fd), Long_val(len));
+  Unlock_samba();
+  leave_blocking_section();
+  if (ret) serror("smbc_ftruncate", Nothing);
+
+  CAMLreturn(Val_unit);
+}
+
+/** Remove a file. */
+CAMLprim value ocaml_samba_unlink(value furl)
+{
+  CAMLparam1(furl);
+  int ret;
+
+  enter_blocking_section();
+  Lock_samba();
+  ret = smbc_unlink(String_val(furl));
+  Unlock_samba();
+  leave_blocking_section();
+  stat_cache_remove(String_val(furl));
+  if (ret) serror("smbc_unlink", furl);
+
+  CAMLreturn(Val_unit);
+}
+
 /** Close a file. */
 CAMLprim value ocaml_samba_close(value fd)
 {
@@ -285,7 +1071,10 @@ CAMLprim value ocaml_samba_close(value fd)
   int ret;
 
   enter_blocking_section();
+  readahead_stop(Int_val(fd));
+  Lock_samba();
   ret = smbc_close(Int_val(fd));
+  Unlock_samba();
   leave_blocking_section();
   if (ret) serror("smbc_close", Nothing);
 
@@ -302,7 +1091,9 @@ CAMLprim value ocaml_samba_opendir(value durl)
   int dir;
 
   enter_blocking_section();
+  Lock_samba();
   dir = smbc_opendir(String_val(durl));
+  Unlock_samba();
   leave_blocking_section();
   if (dir < 0)
     serror("smbc_opendir", durl);
@@ -318,7 +1109,9 @@ CAMLprim value ocaml_samba_closedir(value dh)
   int ret;
 
   enter_blocking_section();
+  Lock_samba();
   ret = smbc_closedir(Int_val(dh));
+  Unlock_samba();
   leave_blocking_section();
   if (ret) serror("smbc_closedir", Nothing);
 
@@ -326,6 +1119,18 @@ CAMLprim value ocaml_samba_closedir(value dh)
 }
 
 
+static value val_of_dirent(struct smbc_dirent *d)
+{
+  CAMLparam0();
+  CAMLlocal1(ans);
+
+  ans = alloc_tuple(3);
+  Store_field(ans, 0, Val_int(d->smbc_type - 1));
+  Store_field(ans, 1, copy_string(d->comment));
+  Store_field(ans, 2, copy_string(d->name));
+  CAMLreturn(ans);
+}
+
 /** Read a directory. */
 CAMLprim value ocaml_samba_readdir(value dh)
 {
@@ -333,10 +1138,10 @@ CAMLprim value ocaml_samba_readdir(value dh)
 
   struct smbc_dirent* res;
 
-  CAMLlocal1(result);
-
   enter_blocking_section();
+  Lock_samba();
   res = smbc_readdir(Int_val(dh));
+  Unlock_samba();
   leave_blocking_section();
 
   if (!res) {
@@ -345,9 +1150,1030 @@ CAMLprim value ocaml_samba_readdir(value dh)
     serror("smbc_readdir", Nothing);
   }
 
-  result = alloc_tuple(3);
-  Store_field(result, 0, Val_int(res->smbc_type - 1));
-  Store_field(result, 1, copy_string(res->comment));
-  Store_field(result, 2, copy_string(res->name));
-  CAMLreturn(result);
+  CAMLreturn(val_of_dirent(res));
+}
+
+typedef struct
+{
+  unsigned int type;
+  char *comment;
+  char *name;
+  long size;
+  double mtime;
+} entry_t;
+
+static void free_entries(entry_t *e, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    free(e[i].comment);
+    free(e[i].name);
+  }
+  free(e);
+}
+
+/* Add an entry to a growing array. Returns NULL if there is no memory left. */
+static entry_t *add_entry(entry_t **entries, int *n, int *size,
+                          unsigned int type, const char *comment, const char *name)
+{
+  entry_t *p;
+
+  if (*n == *size) {
+    p = realloc(*entries, 2 * (*size ? *size : 32) * sizeof(entry_t));
+    if (!p) return NULL;
+    *entries = p;
+    *size = 2 * (*size ? *size : 32);
+  }
+  p = &(*entries)[*n];
+  p->type = type;
+  p->comment = strdup(comment);
+  p->name = strdup(name);
+  p->size = -1;
+  p->mtime = 0;
+  (*n)++;
+  if (!p->comment || !p->name) return NULL;
+
+  return p;
+}
+
+/* Entries of a directory designating itself or its parent. */
+static int is_dot_entry(const char *name)
+{
+  return !strcmp(name, ".") || !strcmp(name, "..");
+}
+
+/* Mark an entry of a directory as available in the cache. */
+static void stat_cache_add_entry(const char *dname, const char *name)
+{
+  size_t dlen = strlen(dname);
+  char *path = malloc(dlen + strlen(name) + 2);
+
+  if (!path) return;
+  sprintf(path, "%s%s%s", dname, (dlen > 0 && dname[dlen - 1] == '/') ? "" : "/", name);
+  stat_cache_add(path, 1);
+  free(path);
+}
+
+#ifdef HAVE_SMBC_READDIRPLUS
+#ifndef FILE_ATTRIBUTE_DIRECTORY
+#define FILE_ATTRIBUTE_DIRECTORY 0x10
+#endif
+
+/* Read the entries of a share directory along with their attributes, in one
+ * request per chunk of entries. Returns -1 with errno set to ENOTDIR if the
+ * directory is not in a share (e.g. the list of shares of a server), the
+ * handle is then left untouched. Should be called inside a blocking
+ * section. */
+static int readdirplus_all(int dh, const char *dname, entry_t **entries, int *n, int *size)
+{
+  const struct libsmb_file_info *res;
+  entry_t *p;
+  int first = 1;
+
+  while (1) {
+    Lock_samba();
+    errno = 0;
+    res = smbc_readdirplus(dh);
+    Unlock_samba();
+    if (!res) {
+      if (first && errno == ENOTDIR) return -1;
+      return errno ? -1 : 0;
+    }
+    first = 0;
+    if (is_dot_entry(res->name)) continue;
+    p = add_entry(entries, n, size,
+                  (res->attrs & FILE_ATTRIBUTE_DIRECTORY) ? SMBC_DIR : SMBC_FILE,
+                  "", res->name);
+    if (!p) {
+      errno = ENOMEM;
+      return -1;
+    }
+    p->size = res->size;
+    p->mtime = res->mtime_ts.tv_sec + res->mtime_ts.tv_nsec / 1000000000.;
+    stat_cache_add_entry(dname, p->name);
+  }
+}
+#endif
+
+/* Read the entries of a directory and stat files and directories, one at a
+ * time, so that other threads can use libsmbclient meanwhile. Should be called
+ * inside a blocking section. */
+static int readdir_stat_all(int dh, const char *dname, entry_t **entries, int *n, int *size)
+{
+  struct smbc_dirent *res;
+  struct stat st;
+  entry_t *p;
+  char *path = NULL;
+  size_t dlen = strlen(dname), pathlen = 0, l;
+  const char *sep = (dlen > 0 && dname[dlen - 1] == '/') ? "" : "/";
+  int ret, dot;
+
+  while (1) {
+    Lock_samba();
+    errno = 0;
+    res = smbc_readdir(dh);
+    dot = res && is_dot_entry(res->name);
+    if (res && !dot)
+      p = add_entry(entries, n, size, res->smbc_type, res->comment, res->name);
+    Unlock_samba();
+    if (!res) {
+      free(path);
+      return errno ? -1 : 0;
+    }
+    if (dot) continue;
+    if (!p) break;
+
+    if (p->type == SMBC_FILE || p->type == SMBC_DIR) {
+      l = dlen + strlen(p->name) + 2;
+      if (l > pathlen) {
+        free(path);
+        pathlen = 2 * l;
+        path = malloc(pathlen);
+        if (!path) break;
+      }
+      sprintf(path, "%s%s%s", dname, sep, p->name);
+      Lock_samba();
+      ret = smbc_stat(path, &st);
+      Unlock_samba();
+      if (ret == 0) {
+        p->size = st.st_size;
+        p->mtime = st.st_mtime;
+        stat_cache_add(path, 1);
+      }
+    }
+  }
+  free(path);
+  errno = ENOMEM;
+
+  return -1;
+}
+
+/** Read all the entries of a directory, with the size and modification time
+ * of files and directories. */
+CAMLprim value ocaml_samba_readdir_all(value dh, value durl)
+{
+  CAMLparam2(dh, durl);
+  CAMLlocal4(ans, e, d, s);
+  char *dname = strdup(String_val(durl));
+  entry_t *entries = NULL;
+  int n = 0, size = 0, err = 0, i, ret = -1;
+
+  if (!dname) caml_raise_out_of_memory();
+
+  enter_blocking_section();
+#ifdef HAVE_SMBC_READDIRPLUS
+  ret = readdirplus_all(Int_val(dh), dname, &entries, &n, &size);
+  if (ret && errno == ENOTDIR && n == 0)
+#endif
+    ret = readdir_stat_all(Int_val(dh), dname, &entries, &n, &size);
+  if (ret) err = errno ? errno : EIO;
+  leave_blocking_section();
+  free(dname);
+
+  if (err) {
+    free_entries(entries, n);
+    samba_error(err, "smbc_readdir", Nothing);
+  }
+
+  ans = caml_alloc_tuple(n);
+  for (i = 0; i < n; i++) {
+    d = caml_alloc_tuple(3);
+    Store_field(d, 0, Val_int(entries[i].type - 1));
+    s = copy_string(entries[i].comment);
+    Store_field(d, 1, s);
+    s = copy_string(entries[i].name);
+    Store_field(d, 2, s);
+    e = caml_alloc_tuple(3);
+    Store_field(e, 0, d);
+    Store_field(e, 1, Val_long(entries[i].size));
+    s = caml_copy_double(entries[i].mtime);
+    Store_field(e, 2, s);
+    Store_field(ans, i, e);
+  }
+  free_entries(entries, n);
+
+  CAMLreturn(ans);
+}
+
+/*
+ *  Contexts
+ */
+
+typedef struct
+{
+  SMBCCTX *ctx;
+  value auth;
+  /* A context should not be used by several threads at once. */
+  pthread_mutex_t mutex;
+} context_t;
+
+#define Context_val(v) (*(context_t**)Data_custom_val(v))
+#define Lock_context(c) pthread_mutex_lock(&(c)->mutex)
+#define Unlock_context(c) pthread_mutex_unlock(&(c)->mutex)
+
+/* Files and directories opened in a context are pairs of the context (which
+ * should be kept alive) and an abstract block containing the SMBCFILE. */
+#define Ctx_of_file(v) Context_val(Field(v, 0))
+#define Ctx_file_val(v) (*(SMBCFILE**)&Field(Field(v, 1), 0))
+
+/* Authentication function of the contexts being freed, whose OCaml function
+ * is gone: the hints are left as is. */
+static void ctx_noauth_fn(SMBCCTX *ctx,
+                          const char *srv,
+                          const char *shr,
+                          char *wg, int wglen,
+                          char *un, int unlen,
+                          char *pw, int pwlen)
+{
+}
+
+static void *context_free_thread(void *arg)
+{
+  context_t *c = arg;
+
+  smbc_free_context(c->ctx, 1);
+  pthread_mutex_destroy(&c->mutex);
+  free(c);
+  return NULL;
+}
+
+/* Freeing a context closes its connections, which must not be done from the
+ * GC with the runtime lock held: this is left to a detached thread, or done
+ * here only if none can be created. No other thread can be using the
+ * context anymore. */
+static void finalize_context(value v)
+{
+  context_t *c = Context_val(v);
+  pthread_t thread;
+
+  remove_global_root(&c->auth);
+  smbc_setFunctionAuthDataWithContext(c->ctx, ctx_noauth_fn);
+  if (pthread_create(&thread, NULL, context_free_thread, c))
+    context_free_thread(c);
+  else
+    pthread_detach(thread);
+}
+
+static struct custom_operations context_ops =
+{
+  "ocaml_smbclient_context",
+  finalize_context,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static void ctx_auth_fn(SMBCCTX *ctx,
+                        const char *srv,
+                        const char *shr,
+                        char *wg, int wglen,
+                        char *un, int unlen,
+                        char *pw, int pwlen)
+{
+  context_t *c = smbc_getOptionUserData(ctx);
+
+  samba_auth(&c->auth, srv, shr, wg, wglen, un, unlen, pw, pwlen);
+}
+
+static value val_of_ctx_file(value ctx, SMBCFILE *f)
+{
+  CAMLparam1(ctx);
+  CAMLlocal2(ans, fv);
+
+  fv = caml_alloc(1, Abstract_tag);
+  *(SMBCFILE**)&Field(fv, 0) = f;
+  ans = caml_alloc_tuple(2);
+  Store_field(ans, 0, ctx);
+  Store_field(ans, 1, fv);
+  CAMLreturn(ans);
+}
+
+/** Create a new context. */
+CAMLprim value ocaml_samba_ctx_create(value fn, value debug)
+{
+  CAMLparam2(fn, debug);
+  CAMLlocal1(ans);
+  context_t *c;
+  SMBCCTX *ctx;
+
+#ifdef HAVE_SMBC_THREAD_POSIX
+  static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+  pthread_once(&thread_once, smbc_thread_posix);
+#endif
+
+  c = malloc(sizeof(context_t));
+  if (!c) caml_raise_out_of_memory();
+  c->auth = fn;
+  register_global_root(&c->auth);
+  pthread_mutex_init(&c->mutex, NULL);
+
+  ctx = smbc_new_context();
+  if (!ctx) {
+    remove_global_root(&c->auth);
+    pthread_mutex_destroy(&c->mutex);
+    free(c);
+    serror("smbc_new_context", Nothing);
+  }
+  smbc_setDebug(ctx, Int_val(debug));
+  smbc_setFunctionAuthDataWithContext(ctx, ctx_auth_fn);
+  smbc_setOptionUserData(ctx, c);
+
+  enter_blocking_section();
+  c->ctx = smbc_init_context(ctx);
+  leave_blocking_section();
+  if (!c->ctx) {
+    smbc_free_context(ctx, 0);
+    remove_global_root(&c->auth);
+    pthread_mutex_destroy(&c->mutex);
+    free(c);
+    serror("smbc_init_context", Nothing);
+  }
+
+  ans = caml_alloc_custom(&context_ops, sizeof(context_t*), 1, 100);
+  Context_val(ans) = c;
+  CAMLreturn(ans);
+}
+
+/** Is the file available? */
+CAMLprim value ocaml_samba_ctx_isavail(value ctx, value furl)
+{
+  CAMLparam2(ctx, furl);
+  context_t *c = Context_val(ctx);
+  struct stat st;
+  int ret;
+
+  enter_blocking_section();
+  Lock_context(c);
+  ret = smbc_getFunctionStat(c->ctx)(c->ctx, String_val(furl), &st);
+  Unlock_context(c);
+  leave_blocking_section();
+
+  CAMLreturn(Val_bool(ret >= 0));
+}
+
+/** Open a file in a context. */
+CAMLprim value ocaml_samba_ctx_open(value ctx, value furl, value flags, value mode)
+{
+  CAMLparam4(ctx, furl, flags, mode);
+  context_t *c = Context_val(ctx);
+  int cflags = convert_flag_list(flags, smb_open_flag_table);
+  SMBCFILE *f;
+
+  enter_blocking_section();
+  Lock_context(c);
+  f = smbc_getFunctionOpen(c->ctx)(c->ctx, String_val(furl), cflags, Int_val(mode));
+  Unlock_context(c);
+  leave_blocking_section();
+  if (!f) serror("smbc_open", furl);
+
+  CAMLreturn(val_of_ctx_file(ctx, f));
+}
+
+/** Seek in a file opened in a context. */
+CAMLprim value ocaml_samba_ctx_lseek(value fd, value offset, value whence)
+{
+  CAMLparam3(fd, offset, whence);
+  context_t *c = Ctx_of_file(fd);
+  SMBCFILE *f = Ctx_file_val(fd);
+  off_t ret;
+
+  enter_blocking_section();
+  Lock_context(c);
+  ret = smbc_getFunctionLseek(c->ctx)(c->ctx, f, Long_val(offset),
+                                      seek_command_table[Int_val(whence)]);
+  Unlock_context(c);
+  leave_blocking_section();
+  if (ret == (off_t)-1) serror("smbc_lseek", Nothing);
+  if (ret > Max_long) samba_error(EOVERFLOW, "smbc_lseek", Nothing);
+
+  CAMLreturn(Val_long(ret));
+}
+
+/** Read a file opened in a context. */
+CAMLprim value ocaml_samba_ctx_read(value fd, value buf, value ofs, value len)
+{
+  CAMLparam4(fd, buf, ofs, len);
+  context_t *c = Ctx_of_file(fd);
+  SMBCFILE *f = Ctx_file_val(fd);
+  long numbytes = Long_val(len);
+  ssize_t ret;
+  char iobuf[UNIX_BUFFER_SIZE];
+
+  if (numbytes > UNIX_BUFFER_SIZE) numbytes = UNIX_BUFFER_SIZE;
+  enter_blocking_section();
+  Lock_context(c);
+  ret = smbc_getFunctionRead(c->ctx)(c->ctx, f, iobuf, numbytes);
+  Unlock_context(c);
+  leave_blocking_section();
+  if (ret < 0) serror("smbc_read", Nothing);
+  memmove(&Byte(buf, Long_val(ofs)), iobuf, ret);
+
+  CAMLreturn(Val_long(ret));
+}
+
+/** Read a file opened in a context into a bigarray. */
+CAMLprim value ocaml_samba_ctx_read_ba(value fd, value ba, value ofs, value len)
+{
+  CAMLparam4(fd, ba, ofs, len);
+  context_t *c = Ctx_of_file(fd);
+  SMBCFILE *f = Ctx_file_val(fd);
+  smbc_read_fn rd = smbc_getFunctionRead(c->ctx);
+  char *buf = (char*)Caml_ba_data_val(ba) + Long_val(ofs);
+  size_t n = Long_val(len), done = 0;
+  ssize_t ret = 0;
+
+  enter_blocking_section();
+  Lock_context(c);
+  while (done < n) {
+    ret = rd(c->ctx, f, buf + done, n - done);
+    if (ret <= 0) break;
+    done += ret;
+  }
+  Unlock_context(c);
+  leave_blocking_section();
+  if (ret < 0) serror("smbc_read", Nothing);
+
+  CAMLreturn(Val_long(done));
+}
+
+/** Close a file opened in a context. */
+CAMLprim value ocaml_samba_ctx_close(value fd)
+{
+  CAMLparam1(fd);
+  context_t *c = Ctx_of_file(fd);
+  SMBCFILE *f = Ctx_file_val(fd);
+  int ret;
+
+  enter_blocking_section();
+  Lock_context(c);
+  ret = smbc_getFunctionClose(c->ctx)(c->ctx, f);
+  Unlock_context(c);
+  leave_blocking_section();
+  if (ret) serror("smbc_close", Nothing);
+
+  CAMLreturn(Val_unit);
+}
+
+/** Open a directory in a context. */
+CAMLprim value ocaml_samba_ctx_opendir(value ctx, value durl)
+{
+  CAMLparam2(ctx, durl);
+  context_t *c = Context_val(ctx);
+  SMBCFILE *d;
+
+  enter_blocking_section();
+  Lock_context(c);
+  d = smbc_getFunctionOpendir(c->ctx)(c->ctx, String_val(durl));
+  Unlock_context(c);
+  leave_blocking_section();
+  if (!d) serror("smbc_opendir", durl);
+
+  CAMLreturn(val_of_ctx_file(ctx, d));
+}
+
+/** Close a directory opened in a context. */
+CAMLprim value ocaml_samba_ctx_closedir(value dh)
+{
+  CAMLparam1(dh);
+  context_t *c = Ctx_of_file(dh);
+  SMBCFILE *d = Ctx_file_val(dh);
+  int ret;
+
+  enter_blocking_section();
+  Lock_context(c);
+  ret = smbc_getFunctionClosedir(c->ctx)(c->ctx, d);
+  Unlock_context(c);
+  leave_blocking_section();
+  if (ret) serror("smbc_closedir", Nothing);
+
+  CAMLreturn(Val_unit);
+}
+
+/** Read a directory opened in a context. */
+CAMLprim value ocaml_samba_ctx_readdir(value dh)
+{
+  CAMLparam1(dh);
+  CAMLlocal2(ans, v);
+  context_t *c = Ctx_of_file(dh);
+  SMBCFILE *d = Ctx_file_val(dh);
+  struct smbc_dirent *res;
+  unsigned int type = 0;
+  char *comment = NULL, *name = NULL;
+  int err;
+
+  enter_blocking_section();
+  Lock_context(c);
+  errno = 0;
+  res = smbc_getFunctionReaddir(c->ctx)(c->ctx, d);
+  err = errno;
+  if (res) {
+    /* The entry belongs to the context, copy it while we still own it. */
+    type = res->smbc_type;
+    comment = strdup(res->comment);
+    name = strdup(res->name);
+  }
+  Unlock_context(c);
+  leave_blocking_section();
+
+  if (!res) {
+    if (!err) raise_end_of_file();
+    samba_error(err, "smbc_readdir", Nothing);
+  }
+  if (!comment || !name) {
+    free(comment);
+    free(name);
+    caml_raise_out_of_memory();
+  }
+
+  ans = alloc_tuple(3);
+  Store_field(ans, 0, Val_int(type - 1));
+  v = copy_string(comment);
+  Store_field(ans, 1, v);
+  v = copy_string(name);
+  Store_field(ans, 2, v);
+  free(comment);
+  free(name);
+  CAMLreturn(ans);
+}
+
+/*
+ *  Crawler
+ */
+
+typedef struct crawl_dir
+{
+  char *url;
+  struct crawl_dir *next;
+} crawl_dir_t;
+
+typedef struct crawl_batch
+{
+  int len;
+  char **path;
+  long *size;
+  double *mtime;
+  struct crawl_batch *next;
+} crawl_batch_t;
+
+typedef struct
+{
+  char *workgroup;
+  char *user;
+  char *password;
+  int batch_size;
+  int max_batches;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;  /* a directory is available or crawling is over */
+  pthread_cond_t out_cond;   /* a batch is available or crawling is over */
+  pthread_cond_t space_cond; /* a batch can be added */
+
+  crawl_dir_t *dirs;         /* directories left to crawl */
+  int busy;                  /* number of workers crawling a directory */
+  crawl_batch_t *batches;    /* batches not handed to OCaml yet */
+  crawl_batch_t *last_batch;
+  int nbatches;
+  int running;               /* number of running workers */
+  int errors;
+  int stop;
+  int refs;                  /* the OCaml value and each running worker */
+
+  int nworkers;
+  pthread_t *workers;
+} crawler_t;
+
+#define Crawler_val(v) (*(crawler_t**)Data_custom_val(v))
+
+static void crawl_auth_fn(SMBCCTX *ctx,
+                          const char *srv,
+                          const char *shr,
+                          char *wg, int wglen,
+                          char *un, int unlen,
+                          char *pw, int pwlen)
+{
+  crawler_t *cr = smbc_getOptionUserData(ctx);
+
+  strncpy(wg, cr->workgroup, wglen - 1);
+  wg[wglen - 1] = 0;
+  strncpy(un, cr->user, unlen - 1);
+  un[unlen - 1] = 0;
+  strncpy(pw, cr->password, pwlen - 1);
+  pw[pwlen - 1] = 0;
+}
+
+static crawl_batch_t *crawl_batch_create(int size)
+{
+  crawl_batch_t *b = malloc(sizeof(crawl_batch_t));
+
+  if (!b) return NULL;
+  b->len = 0;
+  b->path = malloc(size * sizeof(char*));
+  b->size = malloc(size * sizeof(long));
+  b->mtime = malloc(size * sizeof(double));
+  b->next = NULL;
+  if (!b->path || !b->size || !b->mtime) {
+    free(b->path);
+    free(b->size);
+    free(b->mtime);
+    free(b);
+    return NULL;
+  }
+
+  return b;
+}
+
+static void crawl_batch_free(crawl_batch_t *b)
+{
+  int i;
+
+  for (i = 0; i < b->len; i++)
+    free(b->path[i]);
+  free(b->path);
+  free(b->size);
+  free(b->mtime);
+  free(b);
+}
+
+/* Hand a batch to OCaml, waiting for some room if needed. Should be called
+ * with the mutex held. */
+static void crawl_push_batch(crawler_t *cr, crawl_batch_t *b)
+{
+  while (!cr->stop && cr->nbatches >= cr->max_batches)
+    pthread_cond_wait(&cr->space_cond, &cr->mutex);
+  if (cr->stop) {
+    crawl_batch_free(b);
+    return;
+  }
+  if (cr->last_batch)
+    cr->last_batch->next = b;
+  else
+    cr->batches = b;
+  cr->last_batch = b;
+  cr->nbatches++;
+  pthread_cond_broadcast(&cr->out_cond);
+}
+
+/* Should be called with the mutex held. */
+static int crawl_push_dir(crawler_t *cr, char *url)
+{
+  crawl_dir_t *d = malloc(sizeof(crawl_dir_t));
+
+  if (!d) {
+    free(url);
+    return -1;
+  }
+  d->url = url;
+  d->next = cr->dirs;
+  cr->dirs = d;
+  pthread_cond_signal(&cr->work_cond);
+
+  return 0;
+}
+
+static int crawl_stopped(crawler_t *cr)
+{
+  int stop;
+
+  pthread_mutex_lock(&cr->mutex);
+  stop = cr->stop;
+  pthread_mutex_unlock(&cr->mutex);
+
+  return stop;
+}
+
+static void crawler_free(crawler_t *cr);
+
+static void *crawl_worker(void *arg)
+{
+  crawler_t *cr = arg;
+  SMBCCTX *ctx, *c;
+  SMBCFILE *dir;
+  struct smbc_dirent *ent;
+  struct stat st;
+  crawl_dir_t *d;
+  crawl_batch_t *b = NULL;
+  char *url;
+  size_t len;
+  int last;
+
+  ctx = smbc_new_context();
+  if (ctx) {
+    smbc_setFunctionAuthDataWithContext(ctx, crawl_auth_fn);
+    smbc_setOptionUserData(ctx, cr);
+    c = smbc_init_context(ctx);
+    if (!c) smbc_free_context(ctx, 0);
+    ctx = c;
+  }
+
+  pthread_mutex_lock(&cr->mutex);
+  if (!ctx) cr->errors++;
+  while (ctx) {
+    while (!cr->stop && !cr->dirs && cr->busy > 0) {
+      /* Do not keep entries while waiting for work. */
+      if (b && b->len > 0) {
+        crawl_push_batch(cr, b);
+        b = NULL;
+        continue;
+      }
+      pthread_cond_wait(&cr->work_cond, &cr->mutex);
+    }
+    if (cr->stop || !cr->dirs) break;
+    d = cr->dirs;
+    cr->dirs = d->next;
+    cr->busy++;
+    pthread_mutex_unlock(&cr->mutex);
+
+    dir = smbc_getFunctionOpendir(ctx)(ctx, d->url);
+    if (!dir) {
+      pthread_mutex_lock(&cr->mutex);
+      cr->errors++;
+      pthread_mutex_unlock(&cr->mutex);
+    }
+    /* Large directories should not delay stopping. */
+    while (dir && !crawl_stopped(cr) && (ent = smbc_getFunctionReaddir(ctx)(ctx, dir))) {
+      if (is_dot_entry(ent->name))
+        continue;
+      len = strlen(d->url) + strlen(ent->name) + 8;
+      url = malloc(len);
+      if (!url) break;
+      if (ent->smbc_type == SMBC_WORKGROUP || ent->smbc_type == SMBC_SERVER)
+        snprintf(url, len, "smb://%s", ent->name);
+      else
+        snprintf(url, len, "%s/%s", d->url, ent->name);
+
+      switch (ent->smbc_type) {
+        case SMBC_WORKGROUP:
+        case SMBC_SERVER:
+        case SMBC_FILE_SHARE:
+        case SMBC_DIR:
+          pthread_mutex_lock(&cr->mutex);
+          if (crawl_push_dir(cr, url)) cr->errors++;
+          pthread_mutex_unlock(&cr->mutex);
+          break;
+
+        case SMBC_FILE:
+          if (!b) b = crawl_batch_create(cr->batch_size);
+          if (!b || smbc_getFunctionStat(ctx)(ctx, url, &st)) {
+            pthread_mutex_lock(&cr->mutex);
+            cr->errors++;
+            pthread_mutex_unlock(&cr->mutex);
+            free(url);
+            break;
+          }
+          b->path[b->len] = url;
+          b->size[b->len] = st.st_size;
+          b->mtime[b->len] = st.st_mtime;
+          b->len++;
+          if (b->len == cr->batch_size) {
+            pthread_mutex_lock(&cr->mutex);
+            crawl_push_batch(cr, b);
+            pthread_mutex_unlock(&cr->mutex);
+            b = NULL;
+          }
+          break;
+
+        default:
+          free(url);
+      }
+    }
+    if (dir) smbc_getFunctionClosedir(ctx)(ctx, dir);
+    free(d->url);
+    free(d);
+
+    pthread_mutex_lock(&cr->mutex);
+    cr->busy--;
+    if (!cr->dirs && cr->busy == 0)
+      pthread_cond_broadcast(&cr->work_cond);
+  }
+  if (b && b->len > 0)
+    crawl_push_batch(cr, b);
+  else if (b)
+    crawl_batch_free(b);
+  cr->running--;
+  pthread_cond_broadcast(&cr->out_cond);
+  pthread_mutex_unlock(&cr->mutex);
+
+  if (ctx) smbc_free_context(ctx, 1);
+
+  /* The crawler is freed by the last of its users. */
+  pthread_mutex_lock(&cr->mutex);
+  last = --cr->refs == 0;
+  pthread_mutex_unlock(&cr->mutex);
+  if (last) crawler_free(cr);
+
+  return NULL;
+}
+
+static void crawler_signal_stop(crawler_t *cr)
+{
+  pthread_mutex_lock(&cr->mutex);
+  cr->stop = 1;
+  pthread_cond_broadcast(&cr->work_cond);
+  pthread_cond_broadcast(&cr->space_cond);
+  pthread_cond_broadcast(&cr->out_cond);
+  pthread_mutex_unlock(&cr->mutex);
+}
+
+/* Should only be called once the workers are over. */
+static void crawler_clear(crawler_t *cr)
+{
+  crawl_dir_t *d;
+  crawl_batch_t *b;
+
+  while (cr->dirs) {
+    d = cr->dirs;
+    cr->dirs = d->next;
+    free(d->url);
+    free(d);
+  }
+  while (cr->batches) {
+    b = cr->batches;
+    cr->batches = b->next;
+    crawl_batch_free(b);
+  }
+  cr->last_batch = NULL;
+  cr->nbatches = 0;
+}
+
+/* Stop a crawler and wait for its workers. Should be called inside a
+ * blocking section. */
+static void crawler_stop(crawler_t *cr)
+{
+  int i;
+
+  crawler_signal_stop(cr);
+  for (i = 0; i < cr->nworkers; i++)
+    pthread_join(cr->workers[i], NULL);
+  cr->nworkers = 0;
+  crawler_clear(cr);
+}
+
+static void crawler_free(crawler_t *cr)
+{
+  crawler_clear(cr);
+  pthread_cond_destroy(&cr->work_cond);
+  pthread_cond_destroy(&cr->out_cond);
+  pthread_cond_destroy(&cr->space_cond);
+  pthread_mutex_destroy(&cr->mutex);
+  free(cr->workers);
+  free(cr->workgroup);
+  free(cr->user);
+  free(cr->password);
+  free(cr);
+}
+
+/* Workers are not waited for here, since they might be in the middle of a
+ * network request: they are detached and the last one frees the crawler. */
+static void finalize_crawler(value v)
+{
+  crawler_t *cr = Crawler_val(v);
+  int i, last;
+
+  crawler_signal_stop(cr);
+  for (i = 0; i < cr->nworkers; i++)
+    pthread_detach(cr->workers[i]);
+  cr->nworkers = 0;
+
+  pthread_mutex_lock(&cr->mutex);
+  last = --cr->refs == 0;
+  pthread_mutex_unlock(&cr->mutex);
+  if (last) crawler_free(cr);
+}
+
+static struct custom_operations crawler_ops =
+{
+  "ocaml_smbclient_crawler",
+  finalize_crawler,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+/** Start crawling a directory. */
+CAMLprim value ocaml_samba_crawl_create(value workers, value batch, value queue, value auth, value durl)
+{
+  CAMLparam5(workers, batch, queue, auth, durl);
+  CAMLlocal1(ans);
+  crawler_t *cr;
+  char *url;
+  int i;
+
+#ifdef HAVE_SMBC_THREAD_POSIX
+  static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+  pthread_once(&thread_once, smbc_thread_posix);
+#endif
+
+  if (Int_val(workers) < 1 || Int_val(batch) < 1 || Int_val(queue) < 1)
+    caml_invalid_argument("Smbclient.Crawler.create");
+
+  cr = calloc(1, sizeof(crawler_t));
+  if (!cr) caml_raise_out_of_memory();
+  cr->refs = 1;
+  ans = caml_alloc_custom(&crawler_ops, sizeof(crawler_t*), 1, 100);
+  Crawler_val(ans) = cr;
+  pthread_mutex_init(&cr->mutex, NULL);
+  pthread_cond_init(&cr->work_cond, NULL);
+  pthread_cond_init(&cr->out_cond, NULL);
+  pthread_cond_init(&cr->space_cond, NULL);
+  cr->batch_size = Int_val(batch);
+  cr->max_batches = Int_val(queue);
+  cr->workgroup = strdup(String_val(Field(auth, 0)));
+  cr->user = strdup(String_val(Field(auth, 1)));
+  cr->password = strdup(String_val(Field(auth, 2)));
+  cr->workers = malloc(Int_val(workers) * sizeof(pthread_t));
+  url = strdup(String_val(durl));
+  if (!cr->workgroup || !cr->user || !cr->password || !cr->workers || !url) {
+    free(url);
+    caml_raise_out_of_memory();
+  }
+  if (crawl_push_dir(cr, url)) caml_raise_out_of_memory();
+
+  for (i = 0; i < Int_val(workers); i++) {
+    /* The worker might be over before pthread_create returns. */
+    pthread_mutex_lock(&cr->mutex);
+    cr->running++;
+    cr->refs++;
+    pthread_mutex_unlock(&cr->mutex);
+    if (pthread_create(&cr->workers[i], NULL, crawl_worker, cr)) {
+      pthread_mutex_lock(&cr->mutex);
+      cr->running--;
+      cr->refs--;
+      pthread_mutex_unlock(&cr->mutex);
+      break;
+    }
+    cr->nworkers++;
+  }
+  if (cr->nworkers == 0)
+    samba_error(EAGAIN, "pthread_create", Nothing);
+
+  CAMLreturn(ans);
+}
+
+/** Get the next batch of files found by a crawler. */
+CAMLprim value ocaml_samba_crawl_next(value crawler)
+{
+  CAMLparam1(crawler);
+  CAMLlocal3(ans, e, s);
+  crawler_t *cr = Crawler_val(crawler);
+  crawl_batch_t *b;
+  int i;
+
+  enter_blocking_section();
+  pthread_mutex_lock(&cr->mutex);
+  while (!cr->batches && cr->running > 0 && !cr->stop)
+    pthread_cond_wait(&cr->out_cond, &cr->mutex);
+  b = cr->batches;
+  if (b) {
+    cr->batches = b->next;
+    if (!cr->batches) cr->last_batch = NULL;
+    cr->nbatches--;
+    pthread_cond_signal(&cr->space_cond);
+  }
+  pthread_mutex_unlock(&cr->mutex);
+  leave_blocking_section();
+
+  if (!b) caml_raise_end_of_file();
+
+  ans = caml_alloc_tuple(b->len);
+  for (i = 0; i < b->len; i++) {
+    s = caml_copy_string(b->path[i]);
+    e = caml_alloc_tuple(3);
+    Store_field(e, 0, s);
+    Store_field(e, 1, Val_long(b->size[i]));
+    Store_field(e, 2, caml_copy_double(b->mtime[i]));
+    Store_field(ans, i, e);
+  }
+  crawl_batch_free(b);
+
+  CAMLreturn(ans);
+}
+
+/** Number of directories or files which could not be crawled. */
+CAMLprim value ocaml_samba_crawl_errors(value crawler)
+{
+  CAMLparam1(crawler);
+  crawler_t *cr = Crawler_val(crawler);
+  int n;
+
+  pthread_mutex_lock(&cr->mutex);
+  n = cr->errors;
+  pthread_mutex_unlock(&cr->mutex);
+
+  CAMLreturn(Val_int(n));
+}
+
+/** Stop a crawler. */
+CAMLprim value ocaml_samba_crawl_stop(value crawler)
+{
+  CAMLparam1(crawler);
+  crawler_t *cr = Crawler_val(crawler);
+
+  enter_blocking_section();
+  crawler_stop(cr);
+  leave_blocking_section();
+
+  CAMLreturn(Val_unit);
 }